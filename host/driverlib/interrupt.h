@@ -0,0 +1,11 @@
+// driverlib/interrupt.h
+//
+// Host stand-in for the TivaWare header, only what kfs.c uses.
+
+#ifndef INTERRUPT_H_
+#define INTERRUPT_H_
+
+int IntMasterDisable(void);
+int IntMasterEnable(void);
+
+#endif /*INTERRUPT_H_*/
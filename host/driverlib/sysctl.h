@@ -0,0 +1,3 @@
+// driverlib/sysctl.h
+//
+// Host stand-in, kfs.c uses nothing from it.
@@ -0,0 +1,326 @@
+// kfs_bench.c
+//
+// Host multi instance throughput test: mounts one kfs_instance per simulated card image and
+// appends log records to all of them at once, one thread per instance, then reads every log
+// back and checks it.  Finally checks that an unaligned append or read reaches the port as a
+// single vectored transaction.
+//
+//   gcc -O2 -pthread -Ihost -I. -o kfs_bench host/kfs_bench.c host/kfs_host.c kfs.c
+//   kfs_bench [-n instances] [-s mb] [-r record_bytes] [-b block_size] [-d dir]
+//
+//   -n  instances (simulated cards) written in parallel (default: 4)
+//   -s  MB of log records written to each instance (default: 64)
+//   -r  record size in bytes (default: 256)
+//   -b  logical block size to format with, up to KFS_MAX_BLOCK_SIZE (default: KFS_DEFAULT_BLOCK_SIZE)
+//   -d  directory for the sparse image files, removed afterwards (default: /tmp)
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "kfs_instance.h"
+
+#define KFS_BENCH_FIXED_BYTES	((unsigned long long)KFS_FIRMWARE_SIZE_BYTES+KFS_CONFIG_SIZE_BYTES+KFS_EVENT_SIZE_BYTES)
+
+typedef struct
+{
+	int image;
+	char path[256];
+	unsigned int sector_count;
+	pthread_mutex_t lock;
+	unsigned long long write_calls;	// vectored transactions issued by kfs
+	unsigned long long read_calls;
+
+	kfs_instance fs;
+	pthread_t thread;
+	unsigned long long records;
+	unsigned int record_bytes;
+	double elapsed;
+	int failed;
+}_kfs_bench_card;
+
+static double kfs_bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/***   Port ops backed by an image file   ***/
+
+static int kfs_bench_installed(void *arg)
+{
+	return 1;
+}
+
+static KFS_RET kfs_bench_disk_initialize(void *arg)
+{
+	return KFS_SUCCESS;
+}
+
+static unsigned int kfs_bench_get_sector_count(void *arg)
+{
+	return ((_kfs_bench_card*)arg)->sector_count;
+}
+
+static KFS_RET kfs_bench_write_sector(void *arg, const unsigned char *buff, unsigned int sector, unsigned int count)
+{
+	_kfs_bench_card *card=(_kfs_bench_card*)arg;
+	size_t length=(size_t)count*SECTOR_SIZE;
+
+	if (pwrite(card->image, buff, length, (off_t)sector*SECTOR_SIZE)!=(ssize_t)length) return KFS_WRITE_ERROR;
+	return KFS_SUCCESS;
+}
+
+static KFS_RET kfs_bench_read_sector(void *arg, unsigned char *buff, unsigned int sector, unsigned int count)
+{
+	_kfs_bench_card *card=(_kfs_bench_card*)arg;
+	size_t length=(size_t)count*SECTOR_SIZE;
+
+	if (pread(card->image, buff, length, (off_t)sector*SECTOR_SIZE)!=(ssize_t)length) return KFS_READ_ERROR;
+	return KFS_SUCCESS;
+}
+
+static KFS_RET kfs_bench_write_sectors_v(void *arg, const kfs_sector_seg *seg, unsigned int segcnt)
+{
+	unsigned int i;
+
+	((_kfs_bench_card*)arg)->write_calls++;
+	for (i=0; i<segcnt; i++)
+	{
+		if (kfs_bench_write_sector(arg, seg[i].buff, seg[i].sector, seg[i].count)!=KFS_SUCCESS) return KFS_WRITE_ERROR;
+	}
+	return KFS_SUCCESS;
+}
+
+static KFS_RET kfs_bench_read_sectors_v(void *arg, const kfs_sector_seg *seg, unsigned int segcnt)
+{
+	unsigned int i;
+
+	((_kfs_bench_card*)arg)->read_calls++;
+	for (i=0; i<segcnt; i++)
+	{
+		if (kfs_bench_read_sector(arg, seg[i].buff, seg[i].sector, seg[i].count)!=KFS_SUCCESS) return KFS_READ_ERROR;
+	}
+	return KFS_SUCCESS;
+}
+
+static void kfs_bench_lock(void *arg)
+{
+	pthread_mutex_lock(&((_kfs_bench_card*)arg)->lock);
+}
+
+static void kfs_bench_unlock(void *arg)
+{
+	pthread_mutex_unlock(&((_kfs_bench_card*)arg)->lock);
+}
+
+static const kfs_port_ops kfs_bench_port =
+{
+	.installed			= kfs_bench_installed,
+	.disk_initialize	= kfs_bench_disk_initialize,
+	.get_sector_count	= kfs_bench_get_sector_count,
+	.write_sector		= kfs_bench_write_sector,
+	.read_sector		= kfs_bench_read_sector,
+	.lock				= kfs_bench_lock,
+	.unlock				= kfs_bench_unlock,
+	.write_sectors_v	= kfs_bench_write_sectors_v,
+	.read_sectors_v		= kfs_bench_read_sectors_v,
+};
+
+/***   Test   ***/
+
+// Record n of a card: its number, then a byte pattern that differs per record and per card
+static void kfs_bench_record(_kfs_bench_card *card, unsigned long long n, unsigned char *record)
+{
+	unsigned int i;
+
+	memcpy(record, &n, sizeof(n));
+	for (i=sizeof(n); i<card->record_bytes-1; i++) record[i]=(unsigned char)(n*31+i+card->image);
+	record[card->record_bytes-1]='\n';
+}
+
+static void *kfs_bench_writer(void *arg)
+{
+	_kfs_bench_card *card=(_kfs_bench_card*)arg;
+	unsigned char *record;
+	unsigned long long n;
+	double started;
+
+	record=malloc(card->record_bytes);
+	if (record==NULL) { card->failed=1; return NULL; }
+
+	started=kfs_bench_now();
+	for (n=0; n<card->records; n++)
+	{
+		kfs_bench_record(card, n, record);
+		if (kfs_write_r(&card->fs, KFS_LOG_FD_INDEX, record, card->record_bytes)!=(int)card->record_bytes)
+		{
+			fprintf(stderr, "%s: write of record %llu failed: %s\n", card->path, n, kfs_strerror(kfs_disk_state_r(&card->fs)));
+			card->failed=1;
+			break;
+		}
+	}
+	card->elapsed=kfs_bench_now()-started;
+
+	free(record);
+	return NULL;
+}
+
+static int kfs_bench_verify(_kfs_bench_card *card)
+{
+	unsigned char *expected;
+	unsigned char *got;
+	unsigned long long n;
+	int ret=0;
+
+	expected=malloc(card->record_bytes);
+	got=malloc(card->record_bytes);
+	if ((expected==NULL)||(got==NULL)) { free(expected); free(got); return -1; }
+
+	if (kfs_file_size_r(&card->fs, KFS_LOG_FD_INDEX)!=card->records*card->record_bytes)
+	{
+		fprintf(stderr, "%s: log holds %llu bytes, wrote %llu\n", card->path, kfs_file_size_r(&card->fs, KFS_LOG_FD_INDEX), card->records*card->record_bytes);
+		ret=-1;
+	}
+
+	kfs_seek_r(&card->fs, KFS_LOG_FD_INDEX, 0, KFS_SEEK_ABSOLUTE);
+	for (n=0; (ret==0)&&(n<card->records); n++)
+	{
+		kfs_bench_record(card, n, expected);
+		if ((kfs_read_r(&card->fs, KFS_LOG_FD_INDEX, got, card->record_bytes)!=(int)card->record_bytes)||(memcmp(got, expected, card->record_bytes)!=0))
+		{
+			fprintf(stderr, "%s: record %llu does not read back\n", card->path, n);
+			ret=-1;
+		}
+	}
+
+	free(expected);
+	free(got);
+	return ret;
+}
+
+// Appends that straddle a block and a read with a partial block at both ends must each be
+// one vectored transaction (a lone block being read back before an append is not counted)
+static int kfs_bench_transactions(_kfs_bench_card *card, unsigned int block_size)
+{
+	unsigned char buff[3*KFS_MAX_BLOCK_SIZE];
+	unsigned long long calls;
+	int i;
+
+	memset(buff, 0x5a, sizeof(buff));
+	for (i=0; i<64; i++)
+	{
+		calls=card->write_calls;
+		if (kfs_write_r(&card->fs, KFS_LOG_FD_INDEX, buff, 300)!=300) return -1;
+		if (card->write_calls-calls!=1)
+		{
+			fprintf(stderr, "%s: 300 byte append %d took %llu transactions\n", card->path, i, card->write_calls-calls);
+			return -1;
+		}
+	}
+
+	calls=card->read_calls;
+	if ((kfs_seek_r(&card->fs, KFS_LOG_FD_INDEX, block_size/2, KFS_SEEK_ABSOLUTE)!=KFS_SUCCESS)||(kfs_read_r(&card->fs, KFS_LOG_FD_INDEX, buff, 2*block_size)!=(int)(2*block_size))) return -1;
+	if (card->read_calls-calls!=1)
+	{
+		fprintf(stderr, "%s: unaligned %u byte read took %llu transactions\n", card->path, 2*block_size, card->read_calls-calls);
+		return -1;
+	}
+	return 0;
+}
+
+static void kfs_bench_usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n instances] [-s mb] [-r record_bytes] [-b block_size] [-d dir]\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	_kfs_bench_card *cards;
+	_kfs_bench_card *card;
+	const char *dir="/tmp";
+	unsigned long long log_bytes=64ULL*1024*1024;
+	unsigned int record_bytes=256;
+	unsigned int block_size=KFS_DEFAULT_BLOCK_SIZE;
+	int count=4;
+	int failed=0;
+	double started;
+	double elapsed;
+	KFS_RET ret;
+	int opt;
+	int i;
+
+	while ((opt=getopt(argc, argv, "n:s:r:b:d:"))!=-1)
+	{
+		switch (opt)
+		{
+			case 'n': count=atoi(optarg); break;
+			case 's': log_bytes=strtoull(optarg, NULL, 0)*1024*1024; break;
+			case 'r': record_bytes=atoi(optarg); break;
+			case 'b': block_size=atoi(optarg); break;
+			case 'd': dir=optarg; break;
+			default:  kfs_bench_usage(argv[0]);
+		}
+	}
+	if ((optind!=argc)||(count<1)||(record_bytes<=sizeof(unsigned long long))) kfs_bench_usage(argv[0]);
+
+	cards=calloc(count, sizeof(_kfs_bench_card));
+	if (cards==NULL) { fprintf(stderr, "out of memory\n"); return 2; }
+
+	// Sparse images with room for the fixed files, the records and a spare MB of log
+	for (i=0; i<count; i++)
+	{
+		card=&cards[i];
+		snprintf(card->path, sizeof(card->path), "%s/kfs_bench_%d.img", dir, i);
+		card->sector_count=(unsigned int)((KFS_BENCH_FIXED_BYTES+log_bytes+2*1024*1024+block_size)/SECTOR_SIZE);
+		card->record_bytes=record_bytes;
+		card->records=log_bytes/record_bytes;
+		pthread_mutex_init(&card->lock, NULL);
+
+		card->image=open(card->path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if ((card->image<0)||(ftruncate(card->image, (off_t)card->sector_count*SECTOR_SIZE)!=0))
+		{
+			perror(card->path);
+			return 2;
+		}
+
+		kfs_instance_init(&card->fs, &kfs_bench_port, card);
+		if (((ret=kfs_format_ex_r(&card->fs, block_size, 0))!=KFS_SUCCESS)||((ret=kfs_init_r(&card->fs))!=KFS_SUCCESS)||((ret=kfs_open_r(&card->fs, KFS_LOG_FD_INDEX, KFS_TRUNCATE))!=KFS_SUCCESS))
+		{
+			fprintf(stderr, "%s: mount failed: %s\n", card->path, kfs_strerror(ret));
+			return 2;
+		}
+	}
+
+	started=kfs_bench_now();
+	for (i=0; i<count; i++) pthread_create(&cards[i].thread, NULL, kfs_bench_writer, &cards[i]);
+	for (i=0; i<count; i++) pthread_join(cards[i].thread, NULL);
+	elapsed=kfs_bench_now()-started;
+
+	for (i=0; i<count; i++)
+	{
+		card=&cards[i];
+		if ((!card->failed)&&(kfs_bench_verify(card)!=0)) card->failed=1;
+		if ((!card->failed)&&(kfs_bench_transactions(card, block_size)!=0)) card->failed=1;
+		failed|=card->failed;
+
+		printf("instance %d: %llu records in %.2fs, %.1f MB/s%s\n", i, card->records, card->elapsed, card->elapsed>0 ? log_bytes/(1024.0*1024.0)/card->elapsed : 0.0, card->failed ? ", FAILED" : "");
+
+		close(card->image);
+		unlink(card->path);
+		pthread_mutex_destroy(&card->lock);
+	}
+
+	printf("%d instances, block size %u, %u byte records: %.1f MB/s aggregate\n", count, block_size, record_bytes, elapsed>0 ? count*(log_bytes/(1024.0*1024.0))/elapsed : 0.0);
+
+	free(cards);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+// kfs_host.c
+//
+// Firmware services kfs.c links against, for host builds.  The built in kfs.h instance has no
+// card on the host (SD_SW reads as removed), host programs mount their own instances through
+// kfs_instance.h with ops backed by image files.
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "kfs_port.h"
+#include "system.h"
+#include "logger.h"
+#include "pinout.h"
+#include "driverlib/interrupt.h"
+
+volatile unsigned int uptime_ms;
+
+int debug_printf(const char *fmt, ...)
+{
+	va_list args;
+	int ret;
+
+	va_start(args, fmt);
+	ret=vfprintf(stderr, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+void log_event(int event_number)
+{
+	fprintf(stderr, "event %d\n", event_number);
+}
+
+int read_input(int input)
+{
+	return 1;
+}
+
+void spi_lock(int lock, int wait)
+{
+}
+
+void spi_unlock(int lock)
+{
+}
+
+int IntMasterDisable(void)
+{
+	return 0;
+}
+
+int IntMasterEnable(void)
+{
+	return 0;
+}
+
+unsigned int kfs_get_sector_count(void)
+{
+	return 0;
+}
+
+KFS_RET kfs_disk_initialize(void)
+{
+	return KFS_NOT_INSTALLED;
+}
+
+KFS_RET kfs_write_sector(const unsigned char *buff, unsigned int sector, unsigned int count)
+{
+	return KFS_WRITE_ERROR;
+}
+
+KFS_RET kfs_read_sector(unsigned char *buff, unsigned int sector, unsigned int count)
+{
+	return KFS_READ_ERROR;
+}
@@ -0,0 +1,13 @@
+// logger.h
+//
+// Host stand-in for the firmware header, only what kfs.c uses.
+
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#define EVENT_NUMBER_DISK_101	101		// sector write needed a retry
+#define EVENT_NUMBER_DISK_201	201		// sector read needed a retry
+
+void log_event(int event_number);
+
+#endif /*LOGGER_H_*/
@@ -0,0 +1,15 @@
+// pinout.h
+//
+// Host stand-in for the firmware header, only what kfs.c uses.
+
+#ifndef PINOUT_H_
+#define PINOUT_H_
+
+#define SD_SW			0
+#define SPI_LOCK_SD		0
+
+int read_input(int input);
+void spi_lock(int lock, int wait);
+void spi_unlock(int lock);
+
+#endif /*PINOUT_H_*/
@@ -0,0 +1,12 @@
+// system.h
+//
+// Host stand-in for the firmware header, only what kfs.c uses.
+
+#ifndef SYSTEM_H_
+#define SYSTEM_H_
+
+extern volatile unsigned int uptime_ms;
+
+int debug_printf(const char *fmt, ...);
+
+#endif /*SYSTEM_H_*/
@@ -5,54 +5,53 @@
 
 #include "kfs_port.h"
 #include "kfs.h"
+#include "kfs_layout.h"
+#include "kfs_instance.h"
 #include "system.h"
 #include "logger.h"
 #include "pinout.h"
 #include "driverlib/sysctl.h"
-
-#define KFS_MAGIC	((unsigned int)(('K'<<0)|('F'<<8)|('S'<<16)|('\0'<<24)))
-#define KFS_VERSION ((unsigned int)(('0'<<0)|('.'<<8)|('1'<<16)|('\0'<<24)))
-
-static KFS_RET disk_state=KFS_BADDISK;
-unsigned int next_update_ms = 0;
+#include "driverlib/interrupt.h"
 
 typedef struct
 {
-	unsigned char sector[SECTOR_SIZE];
-	unsigned int  sector_number;
-}_kfs_buffered_sectors;
+	const kfs_iovec *iov;		// current element
+	unsigned int offset;		// bytes already consumed from the current element
+}_kfs_iov_cursor;
 
-typedef struct
-{
-	unsigned long long sector_start;		// file sector start
-	unsigned long long sector_count;		// number of sectors allocated to this file
+static void kfs_staging_drain(kfs_instance *fs);
+static int kfs_staging_pending(kfs_instance *fs);
+static void kfs_discard_pending(kfs_instance *fs);
+static KFS_RET kfs_sync_locked(kfs_instance *fs);
 
-	unsigned long long start_index;		// byte index from sector_start to start of actual data (used for circular buffers)
-
-	unsigned long long read_index;		// byte index from sector_start
-	unsigned long long write_index;		// byte index from sector_start
-	
-	unsigned long long file_size;			// size in bytes of this file
-	unsigned long long allocated_bytes;	// total size of file
-}_kfs_file_def;
+void kfs_instance_init(kfs_instance *fs, const kfs_port_ops *port, void *port_arg)
+{
+	memset(fs, 0, sizeof(kfs_instance));
+	fs->port=port;
+	fs->port_arg=port_arg;
+	fs->disk_state=KFS_BADDISK;
+}
 
-typedef struct
+static int kfs_card_out(kfs_instance *fs)
 {
-	unsigned int kfs_magic; 		// 4 byte magic to indicate raw_fd system
-	unsigned int kfs_version; 		// raw_fd version number 
-	unsigned long long sector_count;
-	_kfs_file_def files[4]; 		// config, firmware, event, log files
-}_kfs;
+	return !fs->port->installed(fs->port_arg);
+}
 
+static KFS_RET kfs_port_read(kfs_instance *fs, unsigned char *buff, unsigned int sector, unsigned int count)
+{
+	return fs->port->read_sector(fs->port_arg, buff, sector, count);
+}
 
-static _kfs kfs;
-_kfs_buffered_sectors buffered_sectors[4];
+static KFS_RET kfs_port_write(kfs_instance *fs, const unsigned char *buff, unsigned int sector, unsigned int count)
+{
+	return fs->port->write_sector(fs->port_arg, buff, sector, count);
+}
 
-static KFS_RET _kfs_initialize_disk(unsigned long *reported_sector_count)
+static KFS_RET _kfs_initialize_disk(kfs_instance *fs, unsigned long *reported_sector_count)
 {
-	if (read_input(SD_SW)) return KFS_NOT_INSTALLED;
-	if (kfs_disk_initialize()!=KFS_SUCCESS) return KFS_BADDISK;
-	*reported_sector_count=kfs_get_sector_count();
+	if (kfs_card_out(fs)) return KFS_NOT_INSTALLED;
+	if (fs->port->disk_initialize(fs->port_arg)!=KFS_SUCCESS) return KFS_BADDISK;
+	*reported_sector_count=fs->port->get_sector_count(fs->port_arg);
 	return KFS_SUCCESS;
 }
 
@@ -67,97 +66,312 @@ static char *kfs_size_str(unsigned long long size, char *size_str)
 	return size_str;
 }
 
+// Logical blocks are a power of two number of sectors that fits the block buffers
+static int kfs_valid_block_size(unsigned int block_size)
+{
+	if ((block_size<SECTOR_SIZE)||(block_size>KFS_MAX_BLOCK_SIZE)) return 0;
+	if (block_size%SECTOR_SIZE) return 0;
+	return ((block_size&(block_size-1))==0);
+}
+
+static unsigned int kfs_log2(unsigned long long value)
+{
+	unsigned int shift=0;
+	
+	while (value>1) { value>>=1; shift++; }
+	return shift;
+}
+
+static void kfs_load_geometry(kfs_instance *fs)
+{
+	unsigned long long allocated_bytes;
+	int fd_index;
+	
+	fs->geometry.block_size   = fs->kfs.block_size;
+	fs->geometry.block_shift  = kfs_log2(fs->kfs.block_size);
+	fs->geometry.block_mask   = fs->kfs.block_size-1;
+	fs->geometry.block_sectors= fs->kfs.block_size/SECTOR_SIZE;
+	fs->geometry.sector_shift = kfs_log2(fs->geometry.block_sectors);
+	
+	for (fd_index=0; fd_index<4; fd_index++)
+	{
+		allocated_bytes=fs->kfs.files[fd_index].allocated_bytes;
+		
+		fs->geometry.files[fd_index].sector_start=(unsigned int)fs->kfs.files[fd_index].sector_start;
+		fs->geometry.files[fd_index].ring_mask=((allocated_bytes&(allocated_bytes-1))==0) ? (allocated_bytes-1) : 0;
+	}
+}
+
+// Fold an index less than twice the file size back into the file without a 64 bit modulo
+static unsigned long long kfs_ring_wrap(kfs_instance *fs, int fd_index, unsigned long long index)
+{
+	if (fs->geometry.files[fd_index].ring_mask) return index&fs->geometry.files[fd_index].ring_mask;
+	if (index>=fs->kfs.files[fd_index].allocated_bytes) index-=fs->kfs.files[fd_index].allocated_bytes;
+	return index;
+}
+
+// Largest power of two not above value
+static unsigned long kfs_pow2_floor(unsigned long value)
+{
+	return 1UL<<kfs_log2(value);
+}
+
+// Smallest power of two not below value
+static unsigned long kfs_pow2_ceil(unsigned long value)
+{
+	if (value<=1) return 1;
+	return 1UL<<(kfs_log2(value-1)+1);
+}
+
+// Note length bytes from index as no longer holding file data, kfs_periodic passes them to the card
+static void kfs_release(kfs_instance *fs, int fd_index, unsigned long long index, unsigned long long length)
+{
+	_kfs_discard *discard=&fs->discard[fd_index];
+	unsigned long long from=index;
+	unsigned long long to=index+length;
+	
+	if (length==0) return;
+	
+	// Sector 0 still describes this data as live until the next sync
+	fs->discard_synced=0;
+	
+	// A range across the ring end is widened to the whole file, live data is excluded when issuing
+	if (to>fs->kfs.files[fd_index].allocated_bytes)
+	{
+		from=0;
+		to=fs->kfs.files[fd_index].allocated_bytes;
+	}
+	
+	if (discard->from==discard->to)
+	{
+		discard->from=from;
+		discard->to=to;
+		return;
+	}
+	if (from<discard->from) discard->from=from;
+	if (to>discard->to)     discard->to=to;
+}
+
+// True when file bytes [from, to) lie in the free space running from write_index round to start_index
+static int kfs_discard_free(_kfs_file_def *file, unsigned long long from, unsigned long long to)
+{
+	if (file->write_index<file->start_index) return (from>=file->write_index)&&(to<=file->start_index);
+	return (from>=file->write_index)||(to<=file->start_index);
+}
+
+// Discard the free, whole erase blocks of file bytes [from, to), at most *budget of them.
+// Returns where the next pass carries on, to once the range is done.
+static unsigned long long kfs_discard_range(kfs_instance *fs, int fd_index, unsigned long long from, unsigned long long to, unsigned int *budget)
+{
+	_kfs_file_def *file=&fs->kfs.files[fd_index];
+	unsigned int sector_start=fs->geometry.files[fd_index].sector_start;
+	unsigned long long position;
+	unsigned int sector;
+	unsigned int run_first=0;
+	unsigned int run_count=0;
+	
+	sector=sector_start+(unsigned int)((from+SECTOR_SIZE-1)/SECTOR_SIZE);
+	sector=(sector+KFS_ERASE_BLOCK_SECTORS-1)&~(KFS_ERASE_BLOCK_SECTORS-1);
+	
+	for (;;)
+	{
+		position=(unsigned long long)(sector-sector_start)*SECTOR_SIZE;
+		if ((*budget==0)||(position+KFS_ERASE_BLOCK_SECTORS*SECTOR_SIZE>to)) break;
+		
+		if (kfs_discard_free(file, position, position+KFS_ERASE_BLOCK_SECTORS*SECTOR_SIZE))
+		{
+			if (run_count==0) run_first=sector;
+			run_count+=KFS_ERASE_BLOCK_SECTORS;
+			(*budget)--;
+		}
+		else if (run_count)
+		{
+			fs->port->discard_sectors(fs->port_arg, run_first, run_count);
+			run_count=0;
+		}
+		sector+=KFS_ERASE_BLOCK_SECTORS;
+	}
+	
+	//debug_printf("kfs_discard_range: sectors %d-%d\r\n", run_first, run_first+run_count-1);
+	if (run_count) fs->port->discard_sectors(fs->port_arg, run_first, run_count);
+	
+	return (*budget==0) ? position : to;
+}
+
+// Issue the discards noted by kfs_release, minus anything written since.  A few erase blocks
+// per call, the rest stays pending so a freshly formatted card never stalls writers for long.
+static void kfs_discard_pending(kfs_instance *fs)
+{
+	_kfs_discard *discard;
+	unsigned int budget=KFS_DISCARD_BLOCKS_PER_PASS;
+	int fd_index;
+	
+	if (fs->port->discard_sectors==NULL) return;
+	
+	fs->port->lock(fs->port_arg);
+	
+	for (fd_index=0; (fd_index<4)&&(budget>0); fd_index++)
+	{
+		discard=&fs->discard[fd_index];
+		if (discard->from==discard->to) continue;
+		
+		// The superblock on disk must not describe the discarded data as live
+		if (!fs->discard_synced)
+		{
+			if (kfs_sync_locked(fs)!=KFS_SUCCESS) break;
+			fs->discard_synced=1;
+		}
+		
+		discard->from=kfs_discard_range(fs, fd_index, discard->from, discard->to, &budget);
+		if (discard->from>=discard->to)
+		{
+			discard->from=0;
+			discard->to=0;
+		}
+	}
+	
+	fs->port->unlock(fs->port_arg);
+}
+
+// The card never left, so sector 0 is older than the superblock in RAM.  Only restart the disk
+// and keep every append made since the last kfs_sync, reloading is left to a real insertion.
+static KFS_RET kfs_remount(kfs_instance *fs)
+{
+	unsigned long reported_sector_count;
+	
+	if (!fs->mounted) return kfs_init_r(fs);
+	
+	fs->port->lock(fs->port_arg);
+	if (_kfs_initialize_disk(fs, &reported_sector_count)!=KFS_SUCCESS) 	fs->disk_state = KFS_BADDISK;
+	else if (fs->kfs.sector_count!=reported_sector_count) 				fs->disk_state = KFS_MISMATCH_SECTOR_COUNT;
+	else
+	{
+		memset(fs->buffered_sectors, 0, sizeof(fs->buffered_sectors));
+		fs->disk_state = KFS_SUCCESS;
+	}
+	fs->port->unlock(fs->port_arg);
+	
+	// Not the card the superblock came from
+	if (fs->disk_state==KFS_MISMATCH_SECTOR_COUNT) return kfs_init_r(fs);
+	return fs->disk_state;
+}
+
 //Periodicially checks the SD install
-void kfs_periodic(void)
+void kfs_periodic_r(kfs_instance *fs)
 {
-	if (next_update_ms < uptime_ms)
+	if (fs->disk_state == KFS_SUCCESS) kfs_staging_drain(fs);
+	if (fs->disk_state == KFS_SUCCESS) kfs_discard_pending(fs);
+	
+	if (fs->next_update_ms < uptime_ms)
 	{
 	   //No SD card was detected
-	   if (disk_state == KFS_NOT_INSTALLED)
+	   if (fs->disk_state == KFS_NOT_INSTALLED)
 	   {
-		  if (read_input(SD_SW) == 0) //SD card was inserted
+		  if (kfs_card_out(fs) == 0) //SD card was inserted
 		  {
-			  KFS_RET ret = kfs_init();
+			  KFS_RET ret = kfs_init_r(fs);
 			  debug_printf("SD State changed, re-initializing...\r\n");
 			  if ((ret==KFS_UNFORMATTED)||(ret==KFS_BAD_VERSION)||(ret==KFS_MISMATCH_SECTOR_COUNT))
 			  {
 				   debug_printf("Formatting disk...");
-				   ret = kfs_format();
+				   ret = kfs_format_r(fs);
 				   debug_printf("%s\r\n", kfs_strerror(ret));
 
 				   debug_printf("Re-Mounting...");
-				   ret = kfs_init();
+				   ret = kfs_init_r(fs);
 				   debug_printf("%s\r\n", kfs_strerror(ret));
 			  }
 		  }
 	   }
-	   else if (read_input(SD_SW))
+	   else if (kfs_card_out(fs))
 	   {
 		  debug_printf("SD State changed, re-initializing...\r\n");
-		  KFS_RET ret = kfs_init();
+		  KFS_RET ret = kfs_init_r(fs);
 		  if ((ret==KFS_UNFORMATTED)||(ret==KFS_BAD_VERSION)||(ret==KFS_MISMATCH_SECTOR_COUNT))
 		  {
 			   debug_printf("Formatting disk...");
-			   ret = kfs_format();
+			   ret = kfs_format_r(fs);
 			   debug_printf("%s\r\n", kfs_strerror(ret));
 
 			   debug_printf("Re-Mounting...");
-			   ret = kfs_init();
+			   ret = kfs_init_r(fs);
 			   debug_printf("%s\r\n", kfs_strerror(ret));
 		  }
 	   }
-	   next_update_ms = uptime_ms + 1000;
+	   else if ((fs->disk_state != KFS_SUCCESS) && (kfs_staging_pending(fs)))
+	   {
+		  //Records are waiting on a failed disk, try to bring it back
+		  debug_printf("Re-Mounting...");
+		  KFS_RET ret = kfs_remount(fs);
+		  debug_printf("%s\r\n", kfs_strerror(ret));
+	   }
+	   fs->next_update_ms = uptime_ms + 1000;
 	}
 }
 
-KFS_RET kfs_disk_state(void)
+KFS_RET kfs_disk_state_r(kfs_instance *fs)
 {
-	return disk_state;
+	return fs->disk_state;
 }
 
-KFS_RET kfs_init(void)
+KFS_RET kfs_init_r(kfs_instance *fs)
 {
-	next_update_ms = uptime_ms + 5000; //Wait 3 seconds before starting periodic checks
+	fs->next_update_ms = uptime_ms + 5000; //Wait 3 seconds before starting periodic checks
 	unsigned long reported_sector_count;
+	int was_mounted=fs->mounted;
 	
-	if (read_input(SD_SW)) { disk_state = KFS_NOT_INSTALLED; goto done; }
-	if (_kfs_initialize_disk(&reported_sector_count)!=KFS_SUCCESS) { disk_state = KFS_BADDISK; goto done; }
+	fs->mounted=0;
+	if (kfs_card_out(fs)) { fs->disk_state = KFS_NOT_INSTALLED; goto done; }
+	if (_kfs_initialize_disk(fs, &reported_sector_count)!=KFS_SUCCESS) { fs->disk_state = KFS_BADDISK; goto done; }
 	
 	// Get filesystem information
-	if (kfs_read_sector(buffered_sectors[0].sector, 0, 1)!=KFS_SUCCESS)
+	if (kfs_port_read(fs, fs->superblock, 0, 1)!=KFS_SUCCESS)
 	{
-		if (kfs_read_sector(buffered_sectors[0].sector, 0, 1)!=KFS_SUCCESS)
+		if (kfs_port_read(fs, fs->superblock, 0, 1)!=KFS_SUCCESS)
 		{
-			disk_state = KFS_BADDISK; 
+			fs->disk_state = KFS_BADDISK; 
 			goto done;
 		} 
 	}
-	memcpy(&kfs, buffered_sectors[0].sector, sizeof(_kfs));
 	
-	if (kfs.kfs_magic!=KFS_MAGIC) 					{ disk_state = KFS_UNFORMATTED; 			goto done; }
-	if (kfs.kfs_version!=KFS_VERSION) 				{ disk_state = KFS_BAD_VERSION; 			goto done; }
-	if (kfs.sector_count!=reported_sector_count) 	{ disk_state = KFS_MISMATCH_SECTOR_COUNT;	goto done; }
+	// Pending discards were worked out from the superblock in RAM, they only stay when sector 0 is
+	// that same superblock (e.g. kfs_init straight after kfs_format), never for another card
+	if ((!was_mounted)||(memcmp(fs->superblock, &fs->kfs, sizeof(_kfs))!=0))
+	{
+		memset(fs->discard, 0, sizeof(fs->discard));
+		fs->discard_synced=0;
+	}
+	memcpy(&fs->kfs, fs->superblock, sizeof(_kfs));
+	
+	if (fs->kfs.kfs_magic!=KFS_MAGIC) 					{ fs->disk_state = KFS_UNFORMATTED; 			goto done; }
+	if (fs->kfs.kfs_version==KFS_VERSION_0_1)			fs->kfs.block_size = SECTOR_SIZE;	// 0.1 predates block_size
+	else if (fs->kfs.kfs_version!=KFS_VERSION) 			{ fs->disk_state = KFS_BAD_VERSION; 			goto done; }
+	if (!kfs_valid_block_size(fs->kfs.block_size))		{ fs->disk_state = KFS_BAD_BLOCK_SIZE;			goto done; }
+	if (fs->kfs.sector_count!=reported_sector_count) 	{ fs->disk_state = KFS_MISMATCH_SECTOR_COUNT;	goto done; }
 
-	memset(buffered_sectors, 0, sizeof(buffered_sectors));
-	disk_state=KFS_SUCCESS;
+	kfs_load_geometry(fs);
+	memset(fs->buffered_sectors, 0, sizeof(fs->buffered_sectors));
+	fs->mounted=1;
+	fs->disk_state=KFS_SUCCESS;
 	goto done;
 
 done:
-	return disk_state;	
+	return fs->disk_state;	
 }
 
-KFS_RET kfs_sync(void)
+// Caller holds the port lock, so the snapshot never catches a write half way through its index update
+static KFS_RET kfs_sync_locked(kfs_instance *fs)
 {
-	if (read_input(SD_SW)) return KFS_NOT_INSTALLED;
-	memcpy(buffered_sectors[0].sector, &kfs, sizeof(_kfs));
+	if (kfs_card_out(fs)) return KFS_NOT_INSTALLED;
+	memcpy(fs->superblock, &fs->kfs, sizeof(_kfs));
 	
-	disk_state = KFS_SUCCESS;
+	fs->disk_state = KFS_SUCCESS;
 	
-	if (kfs_write_sector(buffered_sectors[0].sector, 0, 1)!=KFS_SUCCESS)
+	if (kfs_port_write(fs, fs->superblock, 0, 1)!=KFS_SUCCESS)
 	{
-		if (kfs_write_sector(buffered_sectors[0].sector, 0, 1)!=KFS_SUCCESS)
+		if (kfs_port_write(fs, fs->superblock, 0, 1)!=KFS_SUCCESS)
 		{
-			disk_state = KFS_BADDISK;
+			fs->disk_state = KFS_BADDISK;
 		}
 		else
 		{
@@ -165,349 +379,517 @@ KFS_RET kfs_sync(void)
 		}
 	}
 	
-	return disk_state;
+	return fs->disk_state;
+}
+
+KFS_RET kfs_sync_r(kfs_instance *fs)
+{
+	KFS_RET ret;
+	
+	fs->port->lock(fs->port_arg);
+	ret=kfs_sync_locked(fs);
+	fs->port->unlock(fs->port_arg);
+	return ret;
+}
+
+KFS_RET kfs_format_r(kfs_instance *fs)
+{
+	return kfs_format_ex_r(fs, KFS_DEFAULT_BLOCK_SIZE, 0);
 }
 
-KFS_RET kfs_format(void)
+KFS_RET kfs_format_ex_r(kfs_instance *fs, unsigned int block_size, unsigned int flags)
 {
 	unsigned long reported_sector_count;
-	unsigned long sectors_used=1;
+	unsigned long block_sectors=block_size/SECTOR_SIZE;
+	unsigned long sectors_used=block_sectors;	// superblock owns the whole first block so files stay block aligned
+	int fd_index;
 	
-	if (read_input(SD_SW)) return (disk_state=KFS_NOT_INSTALLED);
-	if (_kfs_initialize_disk(&reported_sector_count)!=KFS_SUCCESS) return (disk_state=KFS_BADDISK);
+	if (!kfs_valid_block_size(block_size)) return KFS_BAD_BLOCK_SIZE;
+	if (kfs_card_out(fs)) return (fs->disk_state=KFS_NOT_INSTALLED);
+	if (_kfs_initialize_disk(fs, &reported_sector_count)!=KFS_SUCCESS) return (fs->disk_state=KFS_BADDISK);
 
-	kfs.kfs_magic   = KFS_MAGIC;
-	kfs.kfs_version = KFS_VERSION;
-	kfs.sector_count= reported_sector_count;
+	fs->kfs.kfs_magic   = KFS_MAGIC;
+	fs->kfs.kfs_version = KFS_VERSION;
+	fs->kfs.sector_count= reported_sector_count;
+	fs->kfs.block_size  = block_size;
 	
 	// Setup Firmware
-	kfs.files[KFS_FIRMWARE_FD_INDEX].sector_start=sectors_used;
-	kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count=(KFS_FIRMWARE_SIZE_BYTES/SECTOR_SIZE);
-	kfs.files[KFS_FIRMWARE_FD_INDEX].start_index=0;
-	kfs.files[KFS_FIRMWARE_FD_INDEX].read_index=0;
-	kfs.files[KFS_FIRMWARE_FD_INDEX].write_index=0;
-	kfs.files[KFS_FIRMWARE_FD_INDEX].file_size=0;
-	kfs.files[KFS_FIRMWARE_FD_INDEX].allocated_bytes=kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count*SECTOR_SIZE;
-	sectors_used+=kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count;
+	fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_start=sectors_used;
+	fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count=(KFS_FIRMWARE_SIZE_BYTES/block_size)*block_sectors;
+	if (flags&KFS_FORMAT_POW2) fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count=kfs_pow2_ceil(fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count);
+	fs->kfs.files[KFS_FIRMWARE_FD_INDEX].start_index=0;
+	fs->kfs.files[KFS_FIRMWARE_FD_INDEX].read_index=0;
+	fs->kfs.files[KFS_FIRMWARE_FD_INDEX].write_index=0;
+	fs->kfs.files[KFS_FIRMWARE_FD_INDEX].file_size=0;
+	fs->kfs.files[KFS_FIRMWARE_FD_INDEX].allocated_bytes=fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count*SECTOR_SIZE;
+	sectors_used+=fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count;
 	
 	// Setup Config
-	kfs.files[KFS_CONFIG_FD_INDEX].sector_start=sectors_used;
-	kfs.files[KFS_CONFIG_FD_INDEX].sector_count=(KFS_CONFIG_SIZE_BYTES/SECTOR_SIZE);
-	kfs.files[KFS_CONFIG_FD_INDEX].start_index=0;
-	kfs.files[KFS_CONFIG_FD_INDEX].read_index=0;
-	kfs.files[KFS_CONFIG_FD_INDEX].write_index=0;
-	kfs.files[KFS_CONFIG_FD_INDEX].file_size=0;
-	kfs.files[KFS_CONFIG_FD_INDEX].allocated_bytes=kfs.files[KFS_CONFIG_FD_INDEX].sector_count*SECTOR_SIZE;
-	sectors_used+=kfs.files[KFS_CONFIG_FD_INDEX].sector_count;
+	fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_start=sectors_used;
+	fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_count=(KFS_CONFIG_SIZE_BYTES/block_size)*block_sectors;
+	if (flags&KFS_FORMAT_POW2) fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_count=kfs_pow2_ceil(fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_count);
+	fs->kfs.files[KFS_CONFIG_FD_INDEX].start_index=0;
+	fs->kfs.files[KFS_CONFIG_FD_INDEX].read_index=0;
+	fs->kfs.files[KFS_CONFIG_FD_INDEX].write_index=0;
+	fs->kfs.files[KFS_CONFIG_FD_INDEX].file_size=0;
+	fs->kfs.files[KFS_CONFIG_FD_INDEX].allocated_bytes=fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_count*SECTOR_SIZE;
+	sectors_used+=fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_count;
 	
 	// Setup Events
-	kfs.files[KFS_EVENT_FD_INDEX].sector_start=sectors_used;
-	kfs.files[KFS_EVENT_FD_INDEX].sector_count=(KFS_EVENT_SIZE_BYTES/SECTOR_SIZE);
-	kfs.files[KFS_EVENT_FD_INDEX].start_index=0;
-	kfs.files[KFS_EVENT_FD_INDEX].read_index=0;
-	kfs.files[KFS_EVENT_FD_INDEX].write_index=0;
-	kfs.files[KFS_EVENT_FD_INDEX].file_size=0;
-	kfs.files[KFS_EVENT_FD_INDEX].allocated_bytes=kfs.files[KFS_EVENT_FD_INDEX].sector_count*SECTOR_SIZE;
-	sectors_used+=kfs.files[KFS_EVENT_FD_INDEX].sector_count;
+	fs->kfs.files[KFS_EVENT_FD_INDEX].sector_start=sectors_used;
+	fs->kfs.files[KFS_EVENT_FD_INDEX].sector_count=(KFS_EVENT_SIZE_BYTES/block_size)*block_sectors;
+	if (flags&KFS_FORMAT_POW2) fs->kfs.files[KFS_EVENT_FD_INDEX].sector_count=kfs_pow2_ceil(fs->kfs.files[KFS_EVENT_FD_INDEX].sector_count);
+	fs->kfs.files[KFS_EVENT_FD_INDEX].start_index=0;
+	fs->kfs.files[KFS_EVENT_FD_INDEX].read_index=0;
+	fs->kfs.files[KFS_EVENT_FD_INDEX].write_index=0;
+	fs->kfs.files[KFS_EVENT_FD_INDEX].file_size=0;
+	fs->kfs.files[KFS_EVENT_FD_INDEX].allocated_bytes=fs->kfs.files[KFS_EVENT_FD_INDEX].sector_count*SECTOR_SIZE;
+	sectors_used+=fs->kfs.files[KFS_EVENT_FD_INDEX].sector_count;
 	
 	// Setup Logs
-	kfs.files[KFS_LOG_FD_INDEX].sector_start=sectors_used;
-	kfs.files[KFS_LOG_FD_INDEX].sector_count=reported_sector_count-sectors_used;
-	kfs.files[KFS_LOG_FD_INDEX].start_index=0;
-	kfs.files[KFS_LOG_FD_INDEX].read_index=0;
-	kfs.files[KFS_LOG_FD_INDEX].write_index=0;
-	kfs.files[KFS_LOG_FD_INDEX].file_size=0;
-	kfs.files[KFS_LOG_FD_INDEX].allocated_bytes=kfs.files[KFS_LOG_FD_INDEX].sector_count*SECTOR_SIZE;
-	sectors_used+=kfs.files[KFS_LOG_FD_INDEX].sector_count;
+	fs->kfs.files[KFS_LOG_FD_INDEX].sector_start=sectors_used;
+	fs->kfs.files[KFS_LOG_FD_INDEX].sector_count=((reported_sector_count-sectors_used)/block_sectors)*block_sectors;
+	if (flags&KFS_FORMAT_POW2) fs->kfs.files[KFS_LOG_FD_INDEX].sector_count=kfs_pow2_floor(fs->kfs.files[KFS_LOG_FD_INDEX].sector_count);
+	fs->kfs.files[KFS_LOG_FD_INDEX].start_index=0;
+	fs->kfs.files[KFS_LOG_FD_INDEX].read_index=0;
+	fs->kfs.files[KFS_LOG_FD_INDEX].write_index=0;
+	fs->kfs.files[KFS_LOG_FD_INDEX].file_size=0;
+	fs->kfs.files[KFS_LOG_FD_INDEX].allocated_bytes=fs->kfs.files[KFS_LOG_FD_INDEX].sector_count*SECTOR_SIZE;
+	sectors_used+=fs->kfs.files[KFS_LOG_FD_INDEX].sector_count;
 	
-	return kfs_sync();
+	// Whatever the card held before is stale now
+	for (fd_index=0; fd_index<4; fd_index++)
+	{
+		fs->discard[fd_index].from=0;
+		fs->discard[fd_index].to=fs->kfs.files[fd_index].allocated_bytes;
+	}
+	
+	kfs_load_geometry(fs);
+	if (kfs_sync_r(fs)==KFS_SUCCESS) fs->mounted=1;
+	return fs->disk_state;
 }
 
-KFS_RET kfs_open(int fd_index, unsigned int flags)
+KFS_RET kfs_open_r(kfs_instance *fs, int fd_index, unsigned int flags)
 {
-	if (read_input(SD_SW)) return KFS_NOT_INSTALLED;
+	if (kfs_card_out(fs)) return KFS_NOT_INSTALLED;
 	if (fd_index>=4) return KFS_UNKNOWN_FILE;
 
-	if (disk_state!=KFS_SUCCESS)
+	if (fs->disk_state!=KFS_SUCCESS)
 	{
 		debug_printf("Mounting...");
-	    kfs_init();
-	   	debug_printf("%s\r\n", kfs_strerror(disk_state));
+	    kfs_init_r(fs);
+	   	debug_printf("%s\r\n", kfs_strerror(fs->disk_state));
 	    
-	    if ((disk_state==KFS_UNFORMATTED)||(disk_state==KFS_BAD_VERSION)||(disk_state==KFS_MISMATCH_SECTOR_COUNT))
+	    if ((fs->disk_state==KFS_UNFORMATTED)||(fs->disk_state==KFS_BAD_VERSION)||(fs->disk_state==KFS_MISMATCH_SECTOR_COUNT))
 	    {
 	    	debug_printf("Formatting disk...");
-	    	kfs_format();
-	    	debug_printf("%s\r\n", kfs_strerror(disk_state));
+	    	kfs_format_r(fs);
+	    	debug_printf("%s\r\n", kfs_strerror(fs->disk_state));
 	    	
 	    	debug_printf("Re-Mounting...");
-	    	kfs_init();
-	   		debug_printf("%s\r\n", kfs_strerror(disk_state));
+	    	kfs_init_r(fs);
+	   		debug_printf("%s\r\n", kfs_strerror(fs->disk_state));
 	    }
 		
-		if (disk_state!=KFS_SUCCESS) return disk_state;
+		if (fs->disk_state!=KFS_SUCCESS) return fs->disk_state;
 	}
 
-	buffered_sectors[fd_index].sector_number=0;
+	fs->buffered_sectors[fd_index].sector_number=0;
 	
 	
 	if (flags&KFS_TRUNCATE)
 	{
-		kfs.files[fd_index].start_index=0;
-		kfs.files[fd_index].file_size=0;
+		kfs_release(fs, fd_index, fs->kfs.files[fd_index].start_index, fs->kfs.files[fd_index].file_size);
+		fs->kfs.files[fd_index].start_index=0;
+		fs->kfs.files[fd_index].file_size=0;
+		fs->follow[fd_index].reported=0;
 	}
 	
-	kfs.files[fd_index].read_index=kfs.files[fd_index].start_index;	
-	kfs.files[fd_index].write_index = (kfs.files[fd_index].file_size+kfs.files[fd_index].start_index)%kfs.files[fd_index].allocated_bytes;
+	fs->kfs.files[fd_index].read_index=fs->kfs.files[fd_index].start_index;	
+	fs->kfs.files[fd_index].write_index = kfs_ring_wrap(fs, fd_index, fs->kfs.files[fd_index].file_size+fs->kfs.files[fd_index].start_index);
 
-	//debug_printf("OPEN: start=%d, size=%d, write=%d\r\n", kfs.files[fd_index].start_index, kfs.files[fd_index].file_size, kfs.files[fd_index].write_index);
+	//debug_printf("OPEN: start=%d, size=%d, write=%d\r\n", fs->kfs.files[fd_index].start_index, fs->kfs.files[fd_index].file_size, fs->kfs.files[fd_index].write_index);
 	return KFS_SUCCESS;	
 }
 	
-int kfs_eof(int fd_index)
+int kfs_eof_r(kfs_instance *fs, int fd_index)
 {
-	return (kfs.files[fd_index].read_index==kfs.files[fd_index].write_index);
+	return (fs->kfs.files[fd_index].read_index==fs->kfs.files[fd_index].write_index);
 }
 
-unsigned long long kfs_file_size(int fd_index)
+unsigned long long kfs_file_size_r(kfs_instance *fs, int fd_index)
 {
-	return kfs.files[fd_index].file_size;
+	return fs->kfs.files[fd_index].file_size;
 }
 
-unsigned long long kfs_file_allocated_size(int fd_index)
+unsigned long long kfs_file_allocated_size_r(kfs_instance *fs, int fd_index)
 {
-	return kfs.files[fd_index].allocated_bytes;
+	return fs->kfs.files[fd_index].allocated_bytes;
 }
 	
-KFS_RET kfs_seek(int fd_index, long long offset, unsigned int type)
+KFS_RET kfs_seek_r(kfs_instance *fs, int fd_index, long long offset, unsigned int type)
 {
-	//debug_printf("SEEK: start=%d, read=%d,  size=%d, allocated=%d\r\n", kfs.files[fd_index].start_index, kfs.files[fd_index].read_index, kfs.files[fd_index].file_size, kfs.files[fd_index].allocated_bytes);
+	//debug_printf("SEEK: start=%d, read=%d,  size=%d, allocated=%d\r\n", fs->kfs.files[fd_index].start_index, fs->kfs.files[fd_index].read_index, fs->kfs.files[fd_index].file_size, fs->kfs.files[fd_index].allocated_bytes);
 	
 	if (type==KFS_SEEK_ABSOLUTE)
 	{
-		if (offset>kfs.files[fd_index].file_size) return KFS_SEEK_ERROR;
+		if (offset>fs->kfs.files[fd_index].file_size) return KFS_SEEK_ERROR;
+		
+		if (offset<0) return KFS_SEEK_ERROR;
 		
-		kfs.files[fd_index].read_index=(kfs.files[fd_index].start_index+offset)%kfs.files[fd_index].allocated_bytes;
+		fs->kfs.files[fd_index].read_index=kfs_ring_wrap(fs, fd_index, fs->kfs.files[fd_index].start_index+offset);
 	}
 	else if (type==KFS_SEEK_RELATIVE)
 	{
-		 if ((offset+kfs.files[fd_index].read_index)>kfs.files[fd_index].file_size) return KFS_SEEK_ERROR;
+		 if ((offset+fs->kfs.files[fd_index].read_index)>fs->kfs.files[fd_index].file_size) return KFS_SEEK_ERROR;
 		 
-		 kfs.files[fd_index].read_index=(kfs.files[fd_index].read_index+offset)%kfs.files[fd_index].allocated_bytes;
+		 if (offset<-(long long)fs->kfs.files[fd_index].allocated_bytes) return KFS_SEEK_ERROR;
+		 
+		 // Stepping backwards past the ring start comes in from the end
+		 if (offset<0) fs->kfs.files[fd_index].read_index=kfs_ring_wrap(fs, fd_index, fs->kfs.files[fd_index].read_index+fs->kfs.files[fd_index].allocated_bytes+offset);
+		 else          fs->kfs.files[fd_index].read_index=kfs_ring_wrap(fs, fd_index, fs->kfs.files[fd_index].read_index+offset);
 	}
 	
-	//debug_printf("SEEK DONE: read=%d\r\n", kfs.files[fd_index].read_index);
+	//debug_printf("SEEK DONE: read=%d\r\n", fs->kfs.files[fd_index].read_index);
 	
 	return KFS_SUCCESS;	
 }
 	
-static int kfs_internal_write(int fd_index, unsigned long long byte_offset, void *buffer, unsigned int length)
+// Copy the next length bytes out of an iovec list, advancing the cursor
+static void kfs_iov_gather(_kfs_iov_cursor *cursor, unsigned char *dest, unsigned int length)
 {
-	int bytes_to_copy;
-	unsigned int sector_number;
-	int bytes_written=0;
-	
-	//debug_printf("kfs_internal_write: byte_offset=%d, length=%d\r\n", byte_offset, length);
-	disk_state = KFS_SUCCESS;
-	
-	buffered_sectors[fd_index].sector_number=0;
+	unsigned int bytes_to_copy;
 
-	if ((byte_offset+length)>kfs.files[fd_index].allocated_bytes)
+	while (length>0)
 	{
-		//debug_printf("kfs_internal_write: writing past end of file\r\n");
-		if ((byte_offset+length)>kfs.files[fd_index].allocated_bytes) return 0;
-		length=kfs.files[fd_index].allocated_bytes-byte_offset;
-		//debug_printf("length is now %d\r\n", length);
+		bytes_to_copy=cursor->iov->length-cursor->offset;
+		if (bytes_to_copy>length) bytes_to_copy=length;
+
+		memcpy(dest, (const unsigned char*)cursor->iov->base+cursor->offset, bytes_to_copy);
+		dest+=bytes_to_copy;
+		length-=bytes_to_copy;
+		cursor->offset+=bytes_to_copy;
+
+		if (cursor->offset==cursor->iov->length)
+		{
+			cursor->iov++;
+			cursor->offset=0;
+		}
 	}
-	
-	if (byte_offset%SECTOR_SIZE)
+}
+
+// Caller's memory for the next length bytes when they sit in one iovec element, advancing the cursor
+static const unsigned char *kfs_iov_direct(_kfs_iov_cursor *cursor, unsigned int length)
+{
+	const unsigned char *base;
+
+	if ((cursor->iov->length-cursor->offset)<length) return NULL;
+
+	base=(const unsigned char*)cursor->iov->base+cursor->offset;
+	cursor->offset+=length;
+
+	if (cursor->offset==cursor->iov->length)
 	{
-		//debug_printf("kfs_internal_write: writing to a non-sector aligned index\r\n");
-	
-		sector_number=kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE);
-		//debug_printf("kfs_write: reading from sector %d\r\n", sector_number);
-		if (kfs_read_sector(buffered_sectors[fd_index].sector, sector_number, 1)!=KFS_SUCCESS)
+		cursor->iov++;
+		cursor->offset=0;
+	}
+	return base;
+}
+
+static KFS_RET kfs_read_block(kfs_instance *fs, unsigned char *block, unsigned int sector_number)
+{
+	if (kfs_port_read(fs, block, sector_number, fs->geometry.block_sectors)!=KFS_SUCCESS)
+	{
+		debug_printf("kfs_read_block: Failed reading disk once, going to try again, tried to read sector %d\r\n", sector_number);
+		if (kfs_port_read(fs, block, sector_number, fs->geometry.block_sectors)!=KFS_SUCCESS)
 		{
-			if (kfs_read_sector(buffered_sectors[fd_index].sector, sector_number, 1)!=KFS_SUCCESS)
-			{
-				return KFS_BADDISK;
-			}
-			else
-			{
-				log_event(EVENT_NUMBER_DISK_201);
-			}
+			return KFS_BADDISK;
 		}
-		
-		bytes_to_copy=SECTOR_SIZE-(byte_offset%SECTOR_SIZE);
-		if (bytes_to_copy>length) bytes_to_copy=length;
-		
-		//debug_printf("kfs_write: bytes_to_copy = %d to offset %d\r\n", bytes_to_copy, (byte_offset%SECTOR_SIZE));
-		
-		memcpy(buffered_sectors[fd_index].sector+(byte_offset%SECTOR_SIZE), buffer, bytes_to_copy);
-		if (kfs_write_sector(buffered_sectors[fd_index].sector, kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE), 1)!=KFS_SUCCESS)
+		else
 		{
-			if (kfs_write_sector(buffered_sectors[fd_index].sector, kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE), 1)!=KFS_SUCCESS)
-			{			
-				return KFS_BADDISK;
-			}
-			else
-			{
-				log_event(EVENT_NUMBER_DISK_101);
-			}
+			log_event(EVENT_NUMBER_DISK_201);
 		}
+	}
+	return KFS_SUCCESS;
+}
 
-		buffer = (unsigned char*)buffer + bytes_to_copy;
-		length-=bytes_to_copy;
-		bytes_written+=bytes_to_copy;
-		byte_offset+=bytes_to_copy;
+static void kfs_batch_reset(_kfs_batch *batch)
+{
+	batch->segcnt=0;
+	batch->bounce_claimed=0;
+	batch->copycnt=0;
+	batch->cache_claimed=0;
+}
+
+// Drop everything queued, the file's cache may hold data that never reached the card
+static void kfs_batch_abort(kfs_instance *fs, int fd_index)
+{
+	fs->buffered_sectors[fd_index].sector_number=0;
+	kfs_batch_reset(&fs->batch);
+}
+
+// One transaction through the vectored port, or one call per segment when the port has none
+static KFS_RET kfs_batch_run(kfs_instance *fs, int write)
+{
+	_kfs_batch *batch=&fs->batch;
+	unsigned int i;
+
+	if (write)
+	{
+		if (fs->port->write_sectors_v!=NULL) return fs->port->write_sectors_v(fs->port_arg, batch->seg, batch->segcnt);
+
+		for (i=0; i<batch->segcnt; i++)
+		{
+			if (kfs_port_write(fs, batch->seg[i].buff, batch->seg[i].sector, batch->seg[i].count)!=KFS_SUCCESS) return KFS_WRITE_ERROR;
+		}
 	}
+	else
+	{
+		if (fs->port->read_sectors_v!=NULL) return fs->port->read_sectors_v(fs->port_arg, batch->seg, batch->segcnt);
 
-	while(length>0)
+		for (i=0; i<batch->segcnt; i++)
+		{
+			if (kfs_port_read(fs, batch->seg[i].buff, batch->seg[i].sector, batch->seg[i].count)!=KFS_SUCCESS) return KFS_READ_ERROR;
+		}
+	}
+	return KFS_SUCCESS;
+}
+
+static KFS_RET kfs_batch_flush(kfs_instance *fs, int fd_index, int write)
+{
+	_kfs_batch *batch=&fs->batch;
+	unsigned int i;
+
+	if (batch->segcnt>0)
 	{
-		if (length>SECTOR_SIZE) bytes_to_copy=SECTOR_SIZE;
-		else                    bytes_to_copy=length;
-		
-		//debug_printf("kfs_internal_write full write bytes_to_copy = %d\r\n", bytes_to_copy);
-		
-		if (kfs_read_sector(buffered_sectors[fd_index].sector, kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE), 1)!=KFS_SUCCESS)
+		if (kfs_batch_run(fs, write)!=KFS_SUCCESS)
 		{
-			if (kfs_read_sector(buffered_sectors[fd_index].sector, kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE), 1)!=KFS_SUCCESS)
+			debug_printf("kfs_batch_flush: Failed transferring %d segments once, going to try again\r\n", batch->segcnt);
+			if (kfs_batch_run(fs, write)!=KFS_SUCCESS)
 			{
+				kfs_batch_abort(fs, fd_index);
 				return KFS_BADDISK;
 			}
 			else
 			{
-				log_event(EVENT_NUMBER_DISK_201);
+				log_event(write?EVENT_NUMBER_DISK_101:EVENT_NUMBER_DISK_201);
 			}
 		}
-		
-		memcpy(buffered_sectors[fd_index].sector, buffer, bytes_to_copy);
+	}
+
+	// Partially read blocks landed in the cache or a bounce block, hand the caller its part
+	for (i=0; i<batch->copycnt; i++) memcpy(batch->copy[i].dest, batch->copy[i].src, batch->copy[i].length);
 
-		if (kfs_write_sector(buffered_sectors[fd_index].sector, kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE), 1)!=KFS_SUCCESS)
+	kfs_batch_reset(batch);
+	return KFS_SUCCESS;
+}
+
+// Make room for one more block once its buffer is known, so nothing still queued gets reused.
+// Only a block bound for the bounce buffer while it is queued forces the list out early.
+static KFS_RET kfs_batch_reserve(kfs_instance *fs, int fd_index, int write, int bounce)
+{
+	if ((fs->batch.segcnt<KFS_BATCH_SEGMENTS)&&(!(bounce&&fs->batch.bounce_claimed))) return KFS_SUCCESS;
+	return kfs_batch_flush(fs, fd_index, write);
+}
+
+static void kfs_batch_add(kfs_instance *fs, unsigned int sector, unsigned int count, unsigned char *buff)
+{
+	_kfs_batch *batch=&fs->batch;
+	kfs_sector_seg *seg;
+
+	// A run that continues both on the card and in memory grows into one multi-block transfer
+	if (batch->segcnt>0)
+	{
+		seg=&batch->seg[batch->segcnt-1];
+		if (((seg->sector+seg->count)==sector)&&((seg->buff+seg->count*SECTOR_SIZE)==buff))
 		{
-			if (kfs_write_sector(buffered_sectors[fd_index].sector, kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE), 1)!=KFS_SUCCESS)
-			{
-				return KFS_BADDISK;
-			}
-			else
-			{
-				log_event(EVENT_NUMBER_DISK_101);
-			}
+			seg->count+=count;
+			return;
 		}
-		
-		buffer = (unsigned char*)buffer + bytes_to_copy;
-		length-=bytes_to_copy;
-		byte_offset+=bytes_to_copy;
-		bytes_written+=bytes_to_copy;
 	}
-	
-	//debug_printf("File Size = %d\r\n", kfs.files[fd->fd_index].file_size);
-	
-	return bytes_written;
+
+	seg=&batch->seg[batch->segcnt++];
+	seg->sector=sector;
+	seg->count=count;
+	seg->buff=buff;
 }
 
-static int kfs_internal_read(int fd_index, unsigned long long byte_offset, void *buffer, unsigned int length)
+// Queues the write, the sectors reach the card in kfs_batch_flush
+static int kfs_internal_write(kfs_instance *fs, int fd_index, unsigned long long byte_offset, _kfs_iov_cursor *cursor, unsigned int length)
 {
-	unsigned int bytes_read=0;
+	_kfs_buffered_sectors *cache=&fs->buffered_sectors[fd_index];
+	unsigned int block_size=fs->geometry.block_size;
+	unsigned int block_sectors=fs->geometry.block_sectors;
 	unsigned int bytes_to_copy;
+	unsigned int block_offset;
 	unsigned int sector_number;
+	const unsigned char *direct;
+	unsigned char *block;
+	int cached;
+	int bytes_written=0;
 	
-	//debug_printf("kfs_read: file_size=%d, byte_index=%d, length=%d\r\n", kfs.files[fd->fd_index].file_size, fd->byte_index, length);
-	disk_state = KFS_SUCCESS;
-	
-	if ((byte_offset+length)>kfs.files[fd_index].allocated_bytes)
+	//debug_printf("kfs_internal_write: byte_offset=%d, length=%d\r\n", byte_offset, length);
+	fs->disk_state = KFS_SUCCESS;
+
+	if ((byte_offset+length)>fs->kfs.files[fd_index].allocated_bytes)
 	{
-		//debug_printf("kfs_read: writing past end of file\r\n");
-		if ((byte_offset+length)>kfs.files[fd_index].allocated_bytes) return 0;
-		length=kfs.files[fd_index].allocated_bytes-byte_offset;
+		//debug_printf("kfs_internal_write: writing past end of file\r\n");
+		return 0;
 	}
 	
-	if (byte_offset%SECTOR_SIZE)
+	// 64 bit offset is only converted once, the loop steps 32 bit sector/offset counters
+	sector_number=fs->geometry.files[fd_index].sector_start+((unsigned int)(byte_offset>>fs->geometry.block_shift)<<fs->geometry.sector_shift);
+	block_offset=(unsigned int)byte_offset&fs->geometry.block_mask;
+	
+	while(length>0)
 	{
-		//debug_printf("kfs_read: reading from a non-sector aligned index\r\n");
-
-		sector_number=kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE);
+		bytes_to_copy=block_size-block_offset;
+		if (bytes_to_copy>length) bytes_to_copy=length;
+		
+		//debug_printf("kfs_internal_write: sector %d, bytes_to_copy = %d to offset %d\r\n", sector_number, bytes_to_copy, block_offset);
+		
+		// A whole block the caller holds contiguously goes to the card straight from their memory
+		direct=NULL;
+		if (bytes_to_copy==block_size) direct=kfs_iov_direct(cursor, block_size);
 		
-		if (buffered_sectors[fd_index].sector_number!=sector_number+1)
-		{	
-			//debug_printf("kfs_read: reading from sector %d\r\n", sector_number);
-			buffered_sectors[fd_index].sector_number=sector_number+1;	
-			if (kfs_read_sector(buffered_sectors[fd_index].sector, sector_number, 1)!=KFS_SUCCESS)
+		// The block a sequential writer continues in is built in the file's cache, so the next append skips the read
+		cached=(direct==NULL)&&((block_offset+bytes_to_copy)<block_size)&&(!fs->batch.cache_claimed);
+		
+		if (kfs_batch_reserve(fs, fd_index, 1, (direct==NULL)&&(!cached))!=KFS_SUCCESS) return KFS_BADDISK;
+		
+		if (direct!=NULL)
+		{
+			block=(unsigned char*)direct;
+		}
+		else
+		{
+			if (cached) block=cache->sector;
+			else        block=fs->batch.bounce;
+			
+			// Only a partially covered block needs its old contents
+			if (bytes_to_copy!=block_size)
 			{
-				debug_printf("kfs_internal_read: Failed reading disk once, going to try again\r\n");
-				if (kfs_read_sector(buffered_sectors[fd_index].sector, sector_number, 1)!=KFS_SUCCESS)
+				if (cache->sector_number==sector_number+1)
 				{
-					return KFS_BADDISK;
+					if (block!=cache->sector) memcpy(block, cache->sector, block_size);
 				}
-				else
+				else if (kfs_read_block(fs, block, sector_number)!=KFS_SUCCESS)
 				{
-					log_event(EVENT_NUMBER_DISK_201);
+					kfs_batch_abort(fs, fd_index);
+					return KFS_BADDISK;
 				}
 			}
-				
+			
+			kfs_iov_gather(cursor, block+block_offset, bytes_to_copy);
 		}
-		else
+		
+		// The cache follows the block built in it and is dropped when another buffer rewrites its block
+		if (block==fs->batch.bounce) fs->batch.bounce_claimed=1;
+		if (block==cache->sector)
 		{
-			//debug_printf("kfs_read: SAVING!  Not reading from sector, already buffered\r\n");
+			cache->sector_number=sector_number+1;
+			fs->batch.cache_claimed=1;
+		}
+		else if (cache->sector_number==sector_number+1)
+		{
+			cache->sector_number=0;
 		}
 		
-		bytes_to_copy=SECTOR_SIZE-(byte_offset%SECTOR_SIZE);
-		if (bytes_to_copy>length) bytes_to_copy=length;
-		
-		//debug_printf("kfs_read: bytes_to_copy = %d\r\n", bytes_to_copy);
+		kfs_batch_add(fs, sector_number, block_sectors, block);
 		
-		memcpy(buffer, buffered_sectors[fd_index].sector+(byte_offset%SECTOR_SIZE), bytes_to_copy);
-		bytes_read+=bytes_to_copy;
-		buffer = (unsigned char*)buffer + bytes_to_copy;
-		byte_offset+=bytes_to_copy;
 		length-=bytes_to_copy;
+		bytes_written+=bytes_to_copy;
+		sector_number+=block_sectors;
+		block_offset=0;
+	}
+	
+	//debug_printf("File Size = %d\r\n", fs->kfs.files[fd->fd_index].file_size);
+	
+	return bytes_written;
+}
+
+// Queues the read, buffer is only filled once kfs_batch_flush returns
+static int kfs_internal_read(kfs_instance *fs, int fd_index, unsigned long long byte_offset, void *buffer, unsigned int length)
+{
+	_kfs_buffered_sectors *cache=&fs->buffered_sectors[fd_index];
+	unsigned int block_size=fs->geometry.block_size;
+	unsigned int block_sectors=fs->geometry.block_sectors;
+	unsigned int bytes_read=0;
+	unsigned int bytes_to_copy;
+	unsigned int block_offset;
+	unsigned int sector_number;
+	unsigned char *block;
+	int bounce;
+	
+	//debug_printf("kfs_read: file_size=%d, byte_index=%d, length=%d\r\n", fs->kfs.files[fd->fd_index].file_size, fd->byte_index, length);
+	fs->disk_state = KFS_SUCCESS;
+	
+	if ((byte_offset+length)>fs->kfs.files[fd_index].allocated_bytes)
+	{
+		//debug_printf("kfs_read: writing past end of file\r\n");
+		if ((byte_offset+length)>fs->kfs.files[fd_index].allocated_bytes) return 0;
+		length=fs->kfs.files[fd_index].allocated_bytes-byte_offset;
 	}
 	
+	// 64 bit offset is only converted once, the loop steps 32 bit sector/offset counters
+	sector_number=fs->geometry.files[fd_index].sector_start+((unsigned int)(byte_offset>>fs->geometry.block_shift)<<fs->geometry.sector_shift);
+	block_offset=(unsigned int)byte_offset&fs->geometry.block_mask;
+	
 	while(length>0)
 	{
-		sector_number=kfs.files[fd_index].sector_start+(byte_offset/SECTOR_SIZE);
+		bytes_to_copy=block_size-block_offset;
+		if (bytes_to_copy>length) bytes_to_copy=length;
 		
-		if (buffered_sectors[fd_index].sector_number!=sector_number+1)
-		{	
-			//debug_printf("kfs_read: reading from sector %d\r\n", sector_number);
-			buffered_sectors[fd_index].sector_number=sector_number+1;	
-			if (kfs_read_sector(buffered_sectors[fd_index].sector, sector_number, 1)!=KFS_SUCCESS)
-			{
-				debug_printf("kfs_internal_read: Failed reading disk once, going to try again, tried to read sector %d\r\n", sector_number);
-				//extern int extra_debug;
-				//extra_debug=1;
-				if (kfs_read_sector(buffered_sectors[fd_index].sector, sector_number, 1)!=KFS_SUCCESS)
-				{
-					debug_printf("kfs_internal_read: Nope...still bad, returning bad disk\r\n");
-					return KFS_BADDISK;
-				}
-				else
-				{
-					log_event(EVENT_NUMBER_DISK_201);
-				}
-			}
+		//debug_printf("kfs_read bytes_to_copy = %d\r\n", bytes_to_copy);
+		
+		// A partial block the cache can neither serve nor keep is read into the bounce block
+		bounce=(bytes_to_copy!=block_size)&&((fs->batch.cache_claimed)||((cache->sector_number!=sector_number+1)&&((block_offset+bytes_to_copy)==block_size)));
+		
+		if (kfs_batch_reserve(fs, fd_index, 0, bounce)!=KFS_SUCCESS) return KFS_BADDISK;
+		
+		if (bytes_to_copy==block_size)
+		{
+			// Whole blocks land straight in the caller's buffer
+			kfs_batch_add(fs, sector_number, block_sectors, (unsigned char*)buffer);
 		}
-		else
+		else if ((cache->sector_number==sector_number+1)&&(!fs->batch.cache_claimed))
 		{
 			//debug_printf("kfs_read: SAVING!  Not reading from sector, already buffered\r\n");
+			memcpy(buffer, cache->sector+block_offset, bytes_to_copy);
+		}
+		else
+		{
+			// Keep the block a sequential reader continues in, its next read is then served from RAM
+			if (((block_offset+bytes_to_copy)<block_size)&&(!fs->batch.cache_claimed))
+			{
+				block=cache->sector;
+				cache->sector_number=sector_number+1;
+				fs->batch.cache_claimed=1;
+			}
+			else
+			{
+				block=fs->batch.bounce;
+				fs->batch.bounce_claimed=1;
+			}
+			
+			kfs_batch_add(fs, sector_number, block_sectors, block);
+			fs->batch.copy[fs->batch.copycnt].dest=(unsigned char*)buffer;
+			fs->batch.copy[fs->batch.copycnt].src=block+block_offset;
+			fs->batch.copy[fs->batch.copycnt].length=bytes_to_copy;
+			fs->batch.copycnt++;
 		}
 		
-		if (length<SECTOR_SIZE) bytes_to_copy=length;
-		else                    bytes_to_copy=SECTOR_SIZE;
-		
-		//debug_printf("kfs_read bytes_to_copy = %d\r\n", bytes_to_copy);
-		
-		memcpy(buffer, buffered_sectors[fd_index].sector, bytes_to_copy);
-		byte_offset+=bytes_to_copy;		
 		bytes_read+=bytes_to_copy;
 		buffer = (unsigned char*)buffer + bytes_to_copy;
 		length-=bytes_to_copy;
+		sector_number+=block_sectors;
+		block_offset=0;
 	}
 	
 	return bytes_read;
 }
 
-int kfs_read(int fd_index, void *buffer, unsigned int length)
+int kfs_read_r(kfs_instance *fs, int fd_index, void *buffer, unsigned int length)
 {
     unsigned long long read_index;
     unsigned long long write_index;
@@ -517,15 +899,15 @@ int kfs_read(int fd_index, void *buffer, unsigned int length)
     
     unsigned int copy1=0;
     unsigned int copy2=0;
-    spi_lock(SPI_LOCK_SD, 1);
+    fs->port->lock(fs->port_arg);
 
-    read_index      = kfs.files[fd_index].read_index;
-    write_index     = kfs.files[fd_index].write_index;
-    allocated_bytes = kfs.files[fd_index].allocated_bytes;
+    read_index      = fs->kfs.files[fd_index].read_index;
+    write_index     = fs->kfs.files[fd_index].write_index;
+    allocated_bytes = fs->kfs.files[fd_index].allocated_bytes;
 
-	disk_state = KFS_SUCCESS;
+	fs->disk_state = KFS_SUCCESS;
 
-	if (read_index==write_index) { spi_unlock(SPI_LOCK_SD); return 0; }
+	if (read_index==write_index) { fs->port->unlock(fs->port_arg); return 0; }
 
     if (write_index>read_index)
     {
@@ -556,11 +938,12 @@ int kfs_read(int fd_index, void *buffer, unsigned int length)
     //SysCtlDelay(system_clock_speed/600000);
     if (copy1>0)
     {
-	    if ((bytes_read=kfs_internal_read(fd_index, read_index, buffer, copy1))!=copy1)
+	    if ((bytes_read=kfs_internal_read(fs, fd_index, read_index, buffer, copy1))!=copy1)
 	    {
-	    	if (bytes_read<0) disk_state=(KFS_RET)bytes_read;
+	    	if (bytes_read<0) fs->disk_state=(KFS_RET)bytes_read;
 	    	debug_printf("kfs_read: ERROR: copy1 failed: copy1=%d, bytes_read=%d\r\n", copy1, bytes_read);
-	    	spi_unlock(SPI_LOCK_SD);
+	    	kfs_batch_abort(fs, fd_index);
+	    	fs->port->unlock(fs->port_arg);
 	    	return 0;
 	    }
     }
@@ -572,11 +955,12 @@ int kfs_read(int fd_index, void *buffer, unsigned int length)
 	if (copy2>0)
 	{    
 	    //debug_printf("READ2: read_index=%d, copy2=%d\r\n", read_index, copy2);
-	    if ((bytes_read=kfs_internal_read(fd_index, read_index, ((unsigned char*)buffer)+copy1, copy2))!=copy2)
+	    if ((bytes_read=kfs_internal_read(fs, fd_index, read_index, ((unsigned char*)buffer)+copy1, copy2))!=copy2)
 	    {
-	    	if (bytes_read<0) disk_state=(KFS_RET)bytes_read;
+	    	if (bytes_read<0) fs->disk_state=(KFS_RET)bytes_read;
 	    	debug_printf("kfs_read: ERROR: copy2 failed: copy2=%d, bytes_read=%d\r\n", copy2, bytes_read);
-	    	spi_unlock(SPI_LOCK_SD);
+	    	kfs_batch_abort(fs, fd_index);
+	    	fs->port->unlock(fs->port_arg);
 	    	return 0;
 	    }
 	}
@@ -584,47 +968,51 @@ int kfs_read(int fd_index, void *buffer, unsigned int length)
     read_index+=copy2;
     if (read_index>=allocated_bytes) read_index=0;
     
-    kfs.files[fd_index].read_index=read_index;
+    // Both halves go to the card as one segment list
+    if (kfs_batch_flush(fs, fd_index, 0)!=KFS_SUCCESS)
+    {
+    	fs->disk_state=KFS_BADDISK;
+    	debug_printf("kfs_read: ERROR: transfer failed: copy1=%d, copy2=%d\r\n", copy1, copy2);
+    	fs->port->unlock(fs->port_arg);
+    	return 0;
+    }
+    
+    fs->kfs.files[fd_index].read_index=read_index;
     
     //debug_printf("kfs: copy1=%d, copy2=%d\r\n", copy1, copy2);
-    //debug_printf("kfs_read END: start=%d, read=%d, write=%d, size=%d\r\n\r\n", kfs.files[fd_index].start_index, kfs.files[fd_index].read_index, kfs.files[fd_index].write_index, kfs.files[fd_index].file_size);
-	spi_unlock(SPI_LOCK_SD);
+    //debug_printf("kfs_read END: start=%d, read=%d, write=%d, size=%d\r\n\r\n", fs->kfs.files[fd_index].start_index, fs->kfs.files[fd_index].read_index, fs->kfs.files[fd_index].write_index, fs->kfs.files[fd_index].file_size);
+	fs->port->unlock(fs->port_arg);
     return copy1+copy2;
 }
 
-int kfs_write(int fd_index, void *buffer, unsigned int length)
+static int kfs_internal_writev(kfs_instance *fs, int fd_index, const kfs_iovec *iov, unsigned int length)
 {
 	unsigned long long start_index;
     unsigned long long write_index;
     unsigned long long file_size;
     unsigned long long allocated_bytes;
-    unsigned long long next;
+    _kfs_iov_cursor cursor;
     int bytes_written;
+    kfs_follow_cb follow_cb;
+    void *follow_arg;
+    unsigned long long follow_from;
+    unsigned int follow_length;
     
     int copy1=0;
     int copy2=0;
 
-	spi_unlock(SPI_LOCK_SD);
-	start_index     = kfs.files[fd_index].start_index;
-    write_index     = kfs.files[fd_index].write_index;
-    file_size       = kfs.files[fd_index].file_size;
-    allocated_bytes = kfs.files[fd_index].allocated_bytes;
+    cursor.iov=iov;
+    cursor.offset=0;
+
+	fs->port->lock(fs->port_arg);
+	start_index     = fs->kfs.files[fd_index].start_index;
+    write_index     = fs->kfs.files[fd_index].write_index;
+    file_size       = fs->kfs.files[fd_index].file_size;
+    allocated_bytes = fs->kfs.files[fd_index].allocated_bytes;
     
-    disk_state = KFS_SUCCESS;
+    fs->disk_state = KFS_SUCCESS;
     
     if (length>(allocated_bytes-file_size-1)) length=(allocated_bytes-file_size-1);
-    
-    if (length==1)
-    {
-        next=write_index+1;
-        if (next>=allocated_bytes) next=0;
-        if (next==start_index) { spi_unlock(SPI_LOCK_SD); return 0; }
-        kfs_internal_write(fd_index, next, buffer, 1);
-        kfs.files[fd_index].write_index=next;
-        kfs.files[fd_index].file_size++;
-        spi_unlock(SPI_LOCK_SD);
-        return 1;
-    }
             
     // 1: copy from write_index first_copy bytes
     // 2: copy from 0           second_copy bytes
@@ -661,7 +1049,7 @@ int kfs_write(int fd_index, void *buffer, unsigned int length)
     if ((copy1+copy2)!=length)
     {
     	debug_printf("kfs_write_1: ERROR: copy1=%d, copy2=%d, length=%d\r\n", copy1, copy2, length);
-    	spi_unlock(SPI_LOCK_SD);
+    	fs->port->unlock(fs->port_arg);
     	return 0;
     }
     
@@ -669,11 +1057,12 @@ int kfs_write(int fd_index, void *buffer, unsigned int length)
     
 	if (copy1>0)
 	{    
-	    if ((bytes_written=kfs_internal_write(fd_index, write_index, buffer, copy1))!=copy1)
+	    if ((bytes_written=kfs_internal_write(fs, fd_index, write_index, &cursor, copy1))!=copy1)
 	    {
-	    	if (bytes_written<0) disk_state=(KFS_RET)bytes_written;
+	    	if (bytes_written<0) fs->disk_state=(KFS_RET)bytes_written;
 	    	debug_printf("kfs_write_2: ERROR on copy1: copy1=%d, bytes_written=%d\r\n", copy1, bytes_written);
-	    	spi_unlock(SPI_LOCK_SD);
+	    	kfs_batch_abort(fs, fd_index);
+	    	fs->port->unlock(fs->port_arg);
 	    	return 0;
 	    }
 	}
@@ -686,11 +1075,12 @@ int kfs_write(int fd_index, void *buffer, unsigned int length)
     if (copy2>0)
     {
     	//debug_printf("Writing (copy2) %d bytes, write_index=%d, copy1=%d, copy2=%d\r\n", length, write_index, copy1, copy2);
-	    if ((bytes_written=kfs_internal_write(fd_index, write_index, ((unsigned char*)buffer)+copy1, copy2))!=copy2)
+	    if ((bytes_written=kfs_internal_write(fs, fd_index, write_index, &cursor, copy2))!=copy2)
 	    {
-	    	if (bytes_written<0) disk_state=(KFS_RET)bytes_written;
+	    	if (bytes_written<0) fs->disk_state=(KFS_RET)bytes_written;
 	    	debug_printf("kfs_write_2: ERROR on copy2: copy2=%d, bytes_written=%d\r\n", copy2, bytes_written);
-	    	spi_unlock(SPI_LOCK_SD);
+	    	kfs_batch_abort(fs, fd_index);
+	    	fs->port->unlock(fs->port_arg);
 	    	return 0;
 	    }
     }
@@ -698,15 +1088,220 @@ int kfs_write(int fd_index, void *buffer, unsigned int length)
     length-=copy2;
     write_index+=copy2;
     if (write_index>=allocated_bytes) write_index=0;
-    kfs.files[fd_index].write_index=write_index;
-    kfs.files[fd_index].file_size+=(copy1+copy2);
     
-    //debug_printf("kfs_write END: start=%d, read=%d, write=%d, size=%d\r\n\r\n", kfs.files[fd_index].start_index, kfs.files[fd_index].read_index, kfs.files[fd_index].write_index, kfs.files[fd_index].file_size);
-	spi_unlock(SPI_LOCK_SD);
+    // Both halves go to the card as one segment list, then are published with a single index update
+    if (kfs_batch_flush(fs, fd_index, 1)!=KFS_SUCCESS)
+    {
+    	fs->disk_state=KFS_BADDISK;
+    	debug_printf("kfs_write_3: ERROR: transfer failed: copy1=%d, copy2=%d\r\n", copy1, copy2);
+    	fs->port->unlock(fs->port_arg);
+    	return 0;
+    }
+    
+    fs->kfs.files[fd_index].write_index=write_index;
+    fs->kfs.files[fd_index].file_size+=(copy1+copy2);
+    
+    // Wake a tail follower once enough has built up since it was last called
+    follow_cb=fs->follow[fd_index].cb;
+    follow_arg=fs->follow[fd_index].arg;
+    follow_from=fs->follow[fd_index].reported;
+    if (follow_from>file_size) follow_from=fs->follow[fd_index].reported=file_size;	// file was truncated, reformatted or remounted
+    follow_length=(unsigned int)(fs->kfs.files[fd_index].file_size-follow_from);
+    if ((follow_cb!=NULL)&&((copy1+copy2)>0)&&(follow_length>=fs->follow[fd_index].threshold))
+    {
+    	fs->follow[fd_index].reported=fs->kfs.files[fd_index].file_size;
+    	fs->follow[fd_index].calls++;
+    }
+    else
+    {
+    	follow_cb=NULL;
+    }
+    
+    //debug_printf("kfs_write END: start=%d, read=%d, write=%d, size=%d\r\n\r\n", fs->kfs.files[fd_index].start_index, fs->kfs.files[fd_index].read_index, fs->kfs.files[fd_index].write_index, fs->kfs.files[fd_index].file_size);
+	fs->port->unlock(fs->port_arg);
+	
+	// Outside the lock so the follower may call back in, this write's iov only covers its own bytes
+	if (follow_cb!=NULL)
+	{
+		follow_cb(follow_arg, fd_index, follow_from, (follow_from==file_size) ? iov : NULL, follow_length);
+		
+		fs->port->lock(fs->port_arg);
+		fs->follow[fd_index].calls--;
+		fs->port->unlock(fs->port_arg);
+	}
     return copy1+copy2;
 }
 
-char *kfs_gets(int fd_index, char *buffer, unsigned int max_length)
+static _kfs_staging *kfs_staging_ring(kfs_instance *fs, int fd_index)
+{
+#if KFS_STAGING_SIZE_BYTES>0
+	if (fd_index==KFS_EVENT_FD_INDEX) return &fs->staging[0];
+	if (fd_index==KFS_LOG_FD_INDEX)   return &fs->staging[1];
+#endif
+	return NULL;
+}
+
+// Producer side: copy a whole record into the ring or drop it, never waits on the disk.
+// Producers from several tasks are serialised by staging_lock, the consumer only moves tail.
+static int kfs_staging_push(kfs_instance *fs, _kfs_staging *ring, const kfs_iovec *iov, unsigned int length)
+{
+	_kfs_iov_cursor cursor;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int used;
+	unsigned int bytes_to_copy;
+	
+	if (fs->port->staging_lock!=NULL) fs->port->staging_lock(fs->port_arg);
+	head=ring->head;
+	tail=ring->tail;
+	
+	used=(head>=tail) ? (head-tail) : (KFS_STAGING_SIZE_BYTES-tail+head);
+	if (length>(KFS_STAGING_SIZE_BYTES-1-used))
+	{
+		ring->overflow+=length;
+		if (fs->port->staging_unlock!=NULL) fs->port->staging_unlock(fs->port_arg);
+		return 0;
+	}
+	
+	cursor.iov=iov;
+	cursor.offset=0;
+	
+	bytes_to_copy=KFS_STAGING_SIZE_BYTES-head;
+	if (bytes_to_copy>length) bytes_to_copy=length;
+	kfs_iov_gather(&cursor, ring->data+head, bytes_to_copy);
+	if (length>bytes_to_copy) kfs_iov_gather(&cursor, ring->data, length-bytes_to_copy);
+	
+	head+=length;
+	if (head>=KFS_STAGING_SIZE_BYTES) head-=KFS_STAGING_SIZE_BYTES;
+	ring->head=head;
+	if (fs->port->staging_unlock!=NULL) fs->port->staging_unlock(fs->port_arg);
+	
+	return length;
+}
+
+// Consumer side: write everything staged in one kfs_internal_writev per file
+static void kfs_staging_drain(kfs_instance *fs)
+{
+	_kfs_staging *ring;
+	kfs_iovec iov[2];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int length;
+	int bytes_written;
+	int fd_index;
+	
+	for (fd_index=0; fd_index<4; fd_index++)
+	{
+		if (fs->disk_state!=KFS_SUCCESS) return;
+		if ((ring=kfs_staging_ring(fs, fd_index))==NULL) continue;
+		
+		head=ring->head;
+		tail=ring->tail;
+		if (head==tail) continue;
+		
+		if (head>tail)
+		{
+			iov[0].base=ring->data+tail;
+			iov[0].length=head-tail;
+			iov[1].base=ring->data;
+			iov[1].length=0;
+		}
+		else
+		{
+			iov[0].base=ring->data+tail;
+			iov[0].length=KFS_STAGING_SIZE_BYTES-tail;
+			iov[1].base=ring->data;
+			iov[1].length=head;
+		}
+		length=iov[0].length+iov[1].length;
+		
+		bytes_written=kfs_internal_writev(fs, fd_index, iov, length);
+		
+		// Disk went away again, keep the data for the next pass
+		if ((bytes_written<=0)&&(fs->disk_state!=KFS_SUCCESS)) return;
+		
+		// File is full, what did not fit is lost just like a direct write
+		if (bytes_written<(int)length) ring->discarded+=length-(bytes_written>0 ? bytes_written : 0);
+		
+		ring->tail=head;
+	}
+}
+
+static int kfs_staging_pending(kfs_instance *fs)
+{
+#if KFS_STAGING_SIZE_BYTES>0
+	return (fs->staging[0].head!=fs->staging[0].tail)||(fs->staging[1].head!=fs->staging[1].tail);
+#else
+	return 0;
+#endif
+}
+
+KFS_RET kfs_follow_r(kfs_instance *fs, int fd_index, unsigned int threshold, kfs_follow_cb cb, void *arg)
+{
+	if (fd_index>=4) return KFS_UNKNOWN_FILE;
+	
+	fs->port->lock(fs->port_arg);
+	fs->follow[fd_index].cb=cb;
+	fs->follow[fd_index].arg=arg;
+	fs->follow[fd_index].threshold=threshold;
+	fs->follow[fd_index].reported=fs->kfs.files[fd_index].file_size;	// only what is written from now on
+	
+	// Writers that already took the old cb/arg finish before the caller may free arg
+	while (fs->follow[fd_index].calls>0)
+	{
+		fs->port->unlock(fs->port_arg);
+		fs->port->lock(fs->port_arg);
+	}
+	fs->port->unlock(fs->port_arg);
+	return KFS_SUCCESS;
+}
+
+unsigned int kfs_staging_overflow_r(kfs_instance *fs, int fd_index)
+{
+	_kfs_staging *ring=kfs_staging_ring(fs, fd_index);
+	
+	if (ring==NULL) return 0;
+	return ring->overflow+ring->discarded;
+}
+
+int kfs_writev_r(kfs_instance *fs, int fd_index, const kfs_iovec *iov, int iovcnt)
+{
+	_kfs_staging *ring=kfs_staging_ring(fs, fd_index);
+	unsigned int length=0;
+	int bytes_written;
+	int i;
+	
+	for (i=0; i<iovcnt; i++) length+=iov[i].length;
+	if (length==0) return 0;
+	
+	// Staged data goes first, so keep staging until kfs_periodic has drained it
+	if ((ring!=NULL)&&((fs->disk_state!=KFS_SUCCESS)||(kfs_card_out(fs))||(ring->head!=ring->tail)))
+	{
+		return kfs_staging_push(fs, ring, iov, length);
+	}
+	
+	bytes_written=kfs_internal_writev(fs, fd_index, iov, length);
+	
+	// Nothing was committed to the file, hold the record until the disk is back
+	if ((ring!=NULL)&&(bytes_written==0)&&(fs->disk_state!=KFS_SUCCESS))
+	{
+		return kfs_staging_push(fs, ring, iov, length);
+	}
+	
+	return bytes_written;
+}
+
+int kfs_write_r(kfs_instance *fs, int fd_index, void *buffer, unsigned int length)
+{
+	kfs_iovec iov;
+	
+	iov.base=buffer;
+	iov.length=length;
+	
+	return kfs_writev_r(fs, fd_index, &iov, 1);
+}
+
+char *kfs_gets_r(kfs_instance *fs, int fd_index, char *buffer, unsigned int max_length)
 {
 	int length = 0;
 	unsigned char c;
@@ -716,7 +1311,7 @@ char *kfs_gets(int fd_index, char *buffer, unsigned int max_length)
 	// Read bytes until buffer gets filled
 	while (length < max_length - 1) 
 	{
-		if (kfs_read(fd_index, s, 1)!=1) break;  // Break on EOF or error
+		if (kfs_read_r(fs, fd_index, s, 1)!=1) break;  // Break on EOF or error
 		c = s[0];
 
 		if (c == '\r') continue;	// Strip '\r'
@@ -728,31 +1323,32 @@ char *kfs_gets(int fd_index, char *buffer, unsigned int max_length)
 	return length ? buffer : NULL;			// When no data read (eof or error), return with error.	
 }
 
-void kfs_print_stats(void)
+void kfs_print_stats_r(kfs_instance *fs)
 {
 	char size_str1[20];
 	
-	if (kfs.kfs_magic!=KFS_MAGIC)
+	if (fs->kfs.kfs_magic!=KFS_MAGIC)
 	{
 		debug_printf("KFS invalid MAGIC\r\n");
 		return;
 	}
 	
-	if (kfs.kfs_version!=KFS_VERSION)
+	if ((fs->kfs.kfs_version!=KFS_VERSION)&&(fs->kfs.kfs_version!=KFS_VERSION_0_1))
 	{
 		debug_printf("KFS invalid VERSION\r\n");
 		return;
 	}
 	
-	debug_printf("MAGIC:        %s\r\n", (unsigned char*)&kfs.kfs_magic);
-	debug_printf("VERSION:      %s\r\n", (unsigned char*)&kfs.kfs_version);
-	debug_printf("Sector Count: %d\r\n", kfs.sector_count);
+	debug_printf("MAGIC:        %s\r\n", (unsigned char*)&fs->kfs.kfs_magic);
+	debug_printf("VERSION:      %s\r\n", (unsigned char*)&fs->kfs.kfs_version);
+	debug_printf("Sector Count: %d\r\n", fs->kfs.sector_count);
 	debug_printf("Sector Size:  %d\r\n", SECTOR_SIZE);
+	debug_printf("Block Size:   %d\r\n", fs->kfs.block_size);
 	
-	debug_printf("FIRMWARE: %8lld-%8lld (%8d) %8lldb / %s\r\n", kfs.files[KFS_FIRMWARE_FD_INDEX].sector_start, kfs.files[KFS_FIRMWARE_FD_INDEX].sector_start+kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count-1, kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count, kfs.files[KFS_FIRMWARE_FD_INDEX].file_size, kfs_size_str(kfs.files[KFS_FIRMWARE_FD_INDEX].allocated_bytes, size_str1));
-	debug_printf("CONFIG:   %8lld-%8lld (%8d) %8lldb / %s\r\n", kfs.files[KFS_CONFIG_FD_INDEX].sector_start,   kfs.files[KFS_CONFIG_FD_INDEX].sector_start  +kfs.files[KFS_CONFIG_FD_INDEX].sector_count  -1, kfs.files[KFS_CONFIG_FD_INDEX].sector_count,   kfs.files[KFS_CONFIG_FD_INDEX].file_size,   kfs_size_str(kfs.files[KFS_CONFIG_FD_INDEX].allocated_bytes,   size_str1));
-	debug_printf("EVENT     %8lld-%8lld (%8d) %8lldb / %s\r\n", kfs.files[KFS_EVENT_FD_INDEX].sector_start,    kfs.files[KFS_EVENT_FD_INDEX].sector_start   +kfs.files[KFS_EVENT_FD_INDEX].sector_count   -1, kfs.files[KFS_EVENT_FD_INDEX].sector_count,    kfs.files[KFS_EVENT_FD_INDEX].file_size,    kfs_size_str(kfs.files[KFS_EVENT_FD_INDEX].allocated_bytes,    size_str1));
-	debug_printf("LOG       %8lld-%8lld (%8d) %8lldb / %s\r\n", kfs.files[KFS_LOG_FD_INDEX].sector_start,      kfs.files[KFS_LOG_FD_INDEX].sector_start     +kfs.files[KFS_LOG_FD_INDEX].sector_count     -1, kfs.files[KFS_LOG_FD_INDEX].sector_count,      kfs.files[KFS_LOG_FD_INDEX].file_size,      kfs_size_str(kfs.files[KFS_LOG_FD_INDEX].allocated_bytes,      size_str1));
+	debug_printf("FIRMWARE: %8lld-%8lld (%8d) %8lldb / %s\r\n", fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_start, fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_start+fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count-1, fs->kfs.files[KFS_FIRMWARE_FD_INDEX].sector_count, fs->kfs.files[KFS_FIRMWARE_FD_INDEX].file_size, kfs_size_str(fs->kfs.files[KFS_FIRMWARE_FD_INDEX].allocated_bytes, size_str1));
+	debug_printf("CONFIG:   %8lld-%8lld (%8d) %8lldb / %s\r\n", fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_start,   fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_start  +fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_count  -1, fs->kfs.files[KFS_CONFIG_FD_INDEX].sector_count,   fs->kfs.files[KFS_CONFIG_FD_INDEX].file_size,   kfs_size_str(fs->kfs.files[KFS_CONFIG_FD_INDEX].allocated_bytes,   size_str1));
+	debug_printf("EVENT     %8lld-%8lld (%8d) %8lldb / %s\r\n", fs->kfs.files[KFS_EVENT_FD_INDEX].sector_start,    fs->kfs.files[KFS_EVENT_FD_INDEX].sector_start   +fs->kfs.files[KFS_EVENT_FD_INDEX].sector_count   -1, fs->kfs.files[KFS_EVENT_FD_INDEX].sector_count,    fs->kfs.files[KFS_EVENT_FD_INDEX].file_size,    kfs_size_str(fs->kfs.files[KFS_EVENT_FD_INDEX].allocated_bytes,    size_str1));
+	debug_printf("LOG       %8lld-%8lld (%8d) %8lldb / %s\r\n", fs->kfs.files[KFS_LOG_FD_INDEX].sector_start,      fs->kfs.files[KFS_LOG_FD_INDEX].sector_start     +fs->kfs.files[KFS_LOG_FD_INDEX].sector_count     -1, fs->kfs.files[KFS_LOG_FD_INDEX].sector_count,      fs->kfs.files[KFS_LOG_FD_INDEX].file_size,      kfs_size_str(fs->kfs.files[KFS_LOG_FD_INDEX].allocated_bytes,      size_str1));
 }
 
 char *kfs_strerror(KFS_RET error)
@@ -769,8 +1365,125 @@ char *kfs_strerror(KFS_RET error)
 		case KFS_MISMATCH_SECTOR_COUNT:		return "KFS_MISMATCH_SECTOR_COUNT";
 		case KFS_UNKNOWN_FILE:				return "KFS_UNKNOWN_FILE";
 		case KFS_NOT_INSTALLED:				return "KFS_NOT_INSTALLED";
+		case KFS_BAD_BLOCK_SIZE:			return "KFS_BAD_BLOCK_SIZE";
 		default:							return "KFS_UNKNOWN";
 	}
 }
 
+/***   Single instance API, the board's SD slot through kfs_port.h   ***/
+
+static int kfs_default_installed(void *arg)
+{
+	return (read_input(SD_SW)==0);
+}
+
+static KFS_RET kfs_default_disk_initialize(void *arg)
+{
+	return kfs_disk_initialize();
+}
+
+static unsigned int kfs_default_get_sector_count(void *arg)
+{
+	return kfs_get_sector_count();
+}
+
+static KFS_RET kfs_default_write_sector(void *arg, const unsigned char *buff, unsigned int sector, unsigned int count)
+{
+	return kfs_write_sector(buff, sector, count);
+}
+
+static KFS_RET kfs_default_read_sector(void *arg, unsigned char *buff, unsigned int sector, unsigned int count)
+{
+	return kfs_read_sector(buff, sector, count);
+}
+
+#ifdef KFS_PORT_VECTORED
+static KFS_RET kfs_default_write_sectors_v(void *arg, const kfs_sector_seg *seg, unsigned int segcnt)
+{
+	return kfs_write_sectors_v(seg, segcnt);
+}
+
+static KFS_RET kfs_default_read_sectors_v(void *arg, const kfs_sector_seg *seg, unsigned int segcnt)
+{
+	return kfs_read_sectors_v(seg, segcnt);
+}
+#endif
+
+#ifdef KFS_PORT_DISCARD
+static KFS_RET kfs_default_discard_sectors(void *arg, unsigned int sector, unsigned int count)
+{
+	return kfs_discard_sectors(sector, count);
+}
+#endif
+
+static void kfs_default_lock(void *arg)
+{
+	spi_lock(SPI_LOCK_SD, 1);
+}
+
+static void kfs_default_unlock(void *arg)
+{
+	spi_unlock(SPI_LOCK_SD);
+}
+
+// Event and log records come from any task, a staging push only masks interrupts for a memcpy
+static int kfs_default_staging_masked;
+
+static void kfs_default_staging_lock(void *arg)
+{
+	int masked=IntMasterDisable();
+	kfs_default_staging_masked=masked;
+}
+
+static void kfs_default_staging_unlock(void *arg)
+{
+	if (!kfs_default_staging_masked) IntMasterEnable();
+}
+
+static const kfs_port_ops kfs_default_port =
+{
+	kfs_default_installed,
+	kfs_default_disk_initialize,
+	kfs_default_get_sector_count,
+	kfs_default_write_sector,
+	kfs_default_read_sector,
+	kfs_default_lock,
+	kfs_default_unlock,
+#ifdef KFS_PORT_DISCARD
+	kfs_default_discard_sectors,
+#else
+	NULL,
+#endif
+#ifdef KFS_PORT_VECTORED
+	kfs_default_write_sectors_v,
+	kfs_default_read_sectors_v,
+#else
+	NULL,
+	NULL,
+#endif
+	kfs_default_staging_lock,
+	kfs_default_staging_unlock,
+};
+
+static kfs_instance kfs_default = { .port = &kfs_default_port, .port_arg = NULL, .disk_state = KFS_BADDISK };
+
+KFS_RET kfs_disk_state(void)									{ return kfs_disk_state_r(&kfs_default); }
+KFS_RET kfs_init(void)											{ return kfs_init_r(&kfs_default); }
+KFS_RET kfs_sync(void)											{ return kfs_sync_r(&kfs_default); }
+KFS_RET kfs_format(void)										{ return kfs_format_r(&kfs_default); }
+KFS_RET kfs_format_ex(unsigned int block_size, unsigned int flags)	{ return kfs_format_ex_r(&kfs_default, block_size, flags); }
+KFS_RET kfs_open(int fd_index, unsigned int flags)				{ return kfs_open_r(&kfs_default, fd_index, flags); }
+KFS_RET kfs_seek(int fd_index, long long offset, unsigned int type)	{ return kfs_seek_r(&kfs_default, fd_index, offset, type); }
+int kfs_eof(int fd_index)										{ return kfs_eof_r(&kfs_default, fd_index); }
+unsigned long long kfs_file_size(int fd_index)					{ return kfs_file_size_r(&kfs_default, fd_index); }
+unsigned long long kfs_file_allocated_size(int fd_index)		{ return kfs_file_allocated_size_r(&kfs_default, fd_index); }
+int kfs_read(int fd_index, void *buffer, unsigned int length)	{ return kfs_read_r(&kfs_default, fd_index, buffer, length); }
+int kfs_write(int fd_index, void *buffer, unsigned int length)	{ return kfs_write_r(&kfs_default, fd_index, buffer, length); }
+int kfs_writev(int fd_index, const kfs_iovec *iov, int iovcnt)	{ return kfs_writev_r(&kfs_default, fd_index, iov, iovcnt); }
+unsigned int kfs_staging_overflow(int fd_index)					{ return kfs_staging_overflow_r(&kfs_default, fd_index); }
+KFS_RET kfs_follow(int fd_index, unsigned int threshold, kfs_follow_cb cb, void *arg)	{ return kfs_follow_r(&kfs_default, fd_index, threshold, cb, arg); }
+char *kfs_gets(int fd_index, char *buffer, unsigned int max_length)	{ return kfs_gets_r(&kfs_default, fd_index, buffer, max_length); }
+void kfs_print_stats(void)										{ kfs_print_stats_r(&kfs_default); }
+void kfs_periodic(void)											{ kfs_periodic_r(&kfs_default); }
+
 /***   End Of File   ***/
@@ -30,18 +30,46 @@ typedef enum
 	KFS_UNKNOWN_FILE,
 	KFS_NOT_INSTALLED,
 	
+	KFS_BAD_BLOCK_SIZE,
+	
 }KFS_RET;
 
+typedef struct
+{
+	const void *base;
+	unsigned int length;
+}kfs_iovec;
+
+/* Tail follow callback: length bytes appended to fd_index at file offset offset (bytes from the
+ * start of the file) have not been reported before.  When they all came from the write that
+ * triggered the call, iov holds them (it may describe more than length bytes and is only valid
+ * during the call), otherwise iov is NULL and the span is read from the file.  Runs in the
+ * writer's task, so keep it short, e.g. copy out and signal a semaphore, condition variable or
+ * eventfd to wake the reader.  kfs_follow replaces the callback (NULL stops following) and only
+ * returns once calls already made with the old cb/arg have returned, so arg can be freed after
+ * it.  It waits by cycling the disk lock: never call it from inside the callback, nor from a
+ * task that starves the writers on a strictly prioritised scheduler. */
+typedef void (*kfs_follow_cb)(void *arg, int fd_index, unsigned long long offset, const kfs_iovec *iov, unsigned int length);
+
 #define KFS_TRUNCATE 	(1<<0)
 
+/* kfs_format_ex flags.  KFS_FORMAT_POW2 gives every file a power of two size so ring wrap is a mask, trading capacity
+ * for CPU.  The fixed files are rounded up, so they never hold less than their _SIZE_BYTES
+ * (the defaults grow from 310MB to 400MB), and the log is rounded down to fit what is left:
+ * up to half of the remaining card is unused. */
+#define KFS_FORMAT_POW2	(1<<0)
+
 #define KFS_SEEK_RELATIVE 	1
 #define KFS_SEEK_ABSOLUTE 	2
 
+/* These work on the built in instance bound to kfs_port.h, see kfs_instance.h to drive several disks */
+
 KFS_RET kfs_disk_state(void);
 
 KFS_RET kfs_init(void); 	// Initialize, call once
 KFS_RET kfs_sync(void); 	// Write buffered sectors, 
 KFS_RET kfs_format(void); 	// Format the disk, also done internally if it is unformatted upon initialization or sync
+KFS_RET kfs_format_ex(unsigned int block_size, unsigned int flags); // Format with a logical block size (power of two multiple of SECTOR_SIZE up to KFS_MAX_BLOCK_SIZE) and KFS_FORMAT_ flags
 KFS_RET kfs_open(int fd_index, unsigned int flags); // Open a file, each file can be opened itself
 KFS_RET kfs_seek(int fd_index, long long offset, unsigned int type); // Move read index, KFS_SEEK_RELATIVE, KFS_SEEK_ABSOLUTE
 int kfs_eof(int fd_index); // determine if we are at the end of the file
@@ -49,6 +77,9 @@ unsigned long long kfs_file_size(int fd_index); // Number of bytes in file
 unsigned long long kfs_file_allocated_size(int fd_index); // Maximum number of bytes allocated to this file
 int kfs_read(int fd_index, void *buffer, unsigned int length); // read length bytes into buffer from fd_index
 int kfs_write(int fd_index, void *buffer, unsigned int length); // write length bytes from buffer to fd_index
+int kfs_writev(int fd_index, const kfs_iovec *iov, int iovcnt); // gather iovcnt buffers and write them to fd_index as one record
+unsigned int kfs_staging_overflow(int fd_index); // bytes of fd_index dropped because the staging ring was full
+KFS_RET kfs_follow(int fd_index, unsigned int threshold, kfs_follow_cb cb, void *arg); // call cb once threshold bytes of fd_index are unreported (0 or 1: every write), waits out calls to the previous cb
 char *kfs_gets(int fd_index, char *buffer, unsigned int max_length); // get a string of max_length from fd_index and put into buffer
 void kfs_print_stats(void); // Print useful information on disk
 char *kfs_strerror(KFS_RET error); // turn KFS_RET to a string for pretty printing
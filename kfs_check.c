@@ -0,0 +1,490 @@
+// kfs_check.c
+//
+// Host side consistency checker and recovery scanner for KFS card images.
+//
+//   gcc -O2 -pthread -o kfs_check kfs_check.c
+//   kfs_check [-j threads] [-c chunk_mb] [-s] [-a] [-r] [-w] image
+//
+//   -j  number of scanning threads (default: online CPUs)
+//   -c  chunk size in MB handed to each thread (default: 64)
+//   -s  salvage past file_size on the event and log files
+//   -a  salvage past file_size on every file (implies -s)
+//   -r  salvage up to the last non-blank byte instead of the last '\n'
+//   -w  write the corrected superblock back to sector 0 of the image
+//
+// The superblock is only written by kfs_sync, so a card pulled from the field usually holds
+// data past the recorded file_size.  Each file is split into chunks in ring order (starting
+// at start_index) which are scanned in parallel.  A chunk reports blank sectors found inside
+// the live data and, past file_size, the last record boundary before the first blank
+// (erased or never written) sector.  The chunk results are then merged in order to rebuild
+// file_size and write_index.
+//
+// Salvage is off unless asked for: records left behind by KFS_TRUNCATE look exactly like
+// records written after the last kfs_sync, so only use -s on a card known to have lost power
+// or been pulled before it could sync.
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "kfs_port.h"
+#include "kfs.h"
+#include "kfs_layout.h"
+
+#define KFS_CHECK_NONE			(~0ULL)
+#define KFS_CHECK_IO_BYTES		(1024*1024)
+
+typedef struct
+{
+	int fd_index;
+	unsigned long long begin;			// logical byte range [begin, end) counted from start_index
+	unsigned long long end;
+
+	unsigned long long live_blank;		// blank sectors wholly inside [0, file_size)
+	unsigned long long first_blank;		// first blank sector past file_size
+	unsigned long long last_eol;		// one past the last '\n' past file_size, before first_blank
+	unsigned long long last_data;		// one past the last non-blank byte past file_size, before first_blank
+	int error;
+}_kfs_check_chunk;
+
+typedef struct
+{
+	int image;
+	_kfs kfs;
+	int salvage[KFS_FILE_COUNT];
+	int text[KFS_FILE_COUNT];			// record files, where a blank sector inside file_size is a problem
+
+	_kfs_check_chunk *chunks;
+	unsigned int chunk_count;
+	unsigned int next_chunk;
+	unsigned long long salvage_limit[KFS_FILE_COUNT];	// earliest blank sector found so far, chunks past it are skipped
+	unsigned long long bytes_scanned;
+	pthread_mutex_t lock;
+}_kfs_check;
+
+static const char *kfs_check_names[KFS_FILE_COUNT]={ "FIRMWARE", "CONFIG", "EVENT", "LOG" };
+
+static double kfs_check_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+// Read length bytes at logical offset from start_index, following the ring around its end
+static int kfs_check_read(_kfs_check *chk, int fd_index, unsigned long long offset, unsigned char *buffer, unsigned int length)
+{
+	_kfs_file_def *file=&chk->kfs.files[fd_index];
+	unsigned long long base=file->sector_start*SECTOR_SIZE;
+	unsigned long long physical=file->start_index+offset;
+	unsigned int bytes_to_copy;
+	ssize_t got;
+
+	while (length>0)
+	{
+		if (physical>=file->allocated_bytes) physical-=file->allocated_bytes;
+
+		bytes_to_copy=length;
+		if (physical+bytes_to_copy>file->allocated_bytes) bytes_to_copy=file->allocated_bytes-physical;
+
+		got=pread(chk->image, buffer, bytes_to_copy, base+physical);
+		if (got!=(ssize_t)bytes_to_copy)
+		{
+			if (got>=0) errno=EIO;
+			return -1;
+		}
+
+		buffer+=bytes_to_copy;
+		physical+=bytes_to_copy;
+		length-=bytes_to_copy;
+	}
+	return 0;
+}
+
+// A sector is blank when it holds nothing but the erased value of the card, 0x00 or 0xFF
+static int kfs_check_blank(const unsigned char *sector, unsigned int length)
+{
+	unsigned int i;
+
+	if ((sector[0]!=0x00)&&(sector[0]!=0xFF)) return 0;
+	for (i=1; i<length; i++)
+	{
+		if (sector[i]!=sector[0]) return 0;
+	}
+	return 1;
+}
+
+static void kfs_check_scan_chunk(_kfs_check *chk, _kfs_check_chunk *chunk, unsigned char *buffer)
+{
+	_kfs_file_def *file=&chk->kfs.files[chunk->fd_index];
+	unsigned long long live_down=(file->file_size/SECTOR_SIZE)*SECTOR_SIZE;
+	unsigned long long live_up=((file->file_size+SECTOR_SIZE-1)/SECTOR_SIZE)*SECTOR_SIZE;
+	unsigned long long offset=chunk->begin;
+	unsigned long long position;
+	unsigned long long limit;
+	unsigned int length;
+	unsigned int s;
+	unsigned int i;
+
+	chunk->live_blank=0;
+	chunk->first_blank=KFS_CHECK_NONE;
+	chunk->last_eol=KFS_CHECK_NONE;
+	chunk->last_data=KFS_CHECK_NONE;
+
+	while (offset<chunk->end)
+	{
+		// Past file_size nothing beyond the earliest blank sector of this file matters
+		if (offset>=live_up)
+		{
+			if (!chk->salvage[chunk->fd_index]) break;
+
+			pthread_mutex_lock(&chk->lock);
+			limit=chk->salvage_limit[chunk->fd_index];
+			pthread_mutex_unlock(&chk->lock);
+			if (offset>limit) break;
+		}
+
+		length=KFS_CHECK_IO_BYTES;
+		if (offset+length>chunk->end) length=chunk->end-offset;
+
+		if (kfs_check_read(chk, chunk->fd_index, offset, buffer, length)!=0)
+		{
+			chunk->error=errno;
+			return;
+		}
+
+		pthread_mutex_lock(&chk->lock);
+		chk->bytes_scanned+=length;
+		pthread_mutex_unlock(&chk->lock);
+
+		for (s=0; s<length; s+=SECTOR_SIZE)
+		{
+			position=offset+s;
+
+			if (kfs_check_blank(buffer+s, SECTOR_SIZE))
+			{
+				if (position+SECTOR_SIZE<=live_down) chunk->live_blank++;
+				else if (position>=live_up)
+				{
+					chunk->first_blank=position;
+
+					pthread_mutex_lock(&chk->lock);
+					if (position<chk->salvage_limit[chunk->fd_index]) chk->salvage_limit[chunk->fd_index]=position;
+					pthread_mutex_unlock(&chk->lock);
+					return;
+				}
+			}
+
+			if (position+SECTOR_SIZE<=file->file_size) continue;
+
+			for (i=0; i<SECTOR_SIZE; i++)
+			{
+				if (position+i<file->file_size) continue;
+				if (buffer[s+i]=='\n') chunk->last_eol=position+i+1;
+				if ((buffer[s+i]!=0x00)&&(buffer[s+i]!=0xFF)) chunk->last_data=position+i+1;
+			}
+		}
+
+		offset+=length;
+	}
+}
+
+static void *kfs_check_worker(void *arg)
+{
+	_kfs_check *chk=(_kfs_check*)arg;
+	unsigned char *buffer;
+	unsigned int index;
+
+	buffer=malloc(KFS_CHECK_IO_BYTES);
+	if (buffer==NULL) return NULL;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&chk->lock);
+		index=chk->next_chunk++;
+		pthread_mutex_unlock(&chk->lock);
+
+		if (index>=chk->chunk_count) break;
+		kfs_check_scan_chunk(chk, &chk->chunks[index], buffer);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+// Superblock arithmetic checks, returns the number of problems found
+static int kfs_check_superblock(_kfs *kfs, unsigned long long image_sectors, int *usable)
+{
+	unsigned long long block_sectors=kfs->block_size/SECTOR_SIZE;
+	unsigned long long expected_start=block_sectors;
+	unsigned long long expected_write;
+	_kfs_file_def *file;
+	int problems=0;
+	int fd_index;
+
+	if (kfs->sector_count!=image_sectors)
+	{
+		printf("superblock: sector_count %llu does not match image (%llu sectors)\n", kfs->sector_count, image_sectors);
+		problems++;
+	}
+
+	for (fd_index=0; fd_index<KFS_FILE_COUNT; fd_index++)
+	{
+		file=&kfs->files[fd_index];
+		usable[fd_index]=1;
+
+		if (file->sector_start!=expected_start)
+		{
+			printf("%-8s: sector_start %llu, expected %llu\n", kfs_check_names[fd_index], file->sector_start, expected_start);
+			problems++;
+		}
+		if ((file->sector_count==0)||(file->sector_count%block_sectors)||(file->allocated_bytes!=file->sector_count*SECTOR_SIZE))
+		{
+			printf("%-8s: allocated_bytes %llu does not match %llu sectors\n", kfs_check_names[fd_index], file->allocated_bytes, file->sector_count);
+			problems++;
+			usable[fd_index]=0;
+		}
+		if (file->sector_start+file->sector_count>image_sectors)
+		{
+			printf("%-8s: sectors %llu-%llu run past the end of the image\n", kfs_check_names[fd_index], file->sector_start, file->sector_start+file->sector_count-1);
+			problems++;
+			usable[fd_index]=0;
+		}
+		expected_start=file->sector_start+file->sector_count;
+
+		if (!usable[fd_index]) continue;
+
+		if (file->start_index>=file->allocated_bytes)
+		{
+			printf("%-8s: start_index %llu is outside the file\n", kfs_check_names[fd_index], file->start_index);
+			problems++;
+			file->start_index=0;
+		}
+		if (file->file_size>=file->allocated_bytes)
+		{
+			printf("%-8s: file_size %llu exceeds %llu usable bytes\n", kfs_check_names[fd_index], file->file_size, file->allocated_bytes-1);
+			problems++;
+			file->file_size=file->allocated_bytes-1;
+		}
+
+		expected_write=(file->start_index+file->file_size)%file->allocated_bytes;
+		if (file->write_index!=expected_write)
+		{
+			printf("%-8s: write_index %llu, expected %llu from start_index and file_size\n", kfs_check_names[fd_index], file->write_index, expected_write);
+			problems++;
+			file->write_index=expected_write;
+		}
+		if (file->read_index>=file->allocated_bytes)
+		{
+			printf("%-8s: read_index %llu is outside the file\n", kfs_check_names[fd_index], file->read_index);
+			problems++;
+		}
+		file->read_index=file->start_index;
+	}
+
+	// Power of two layouts (KFS_FORMAT_POW2) leave the tail of the disk unused
+	if (expected_start>kfs->sector_count)
+	{
+		printf("superblock: files end at sector %llu, disk has %llu\n", expected_start, kfs->sector_count);
+		problems++;
+	}
+
+	return problems;
+}
+
+static void kfs_check_usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-c chunk_mb] [-s] [-a] [-r] [-w] image\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	_kfs_check chk;
+	unsigned char sector[SECTOR_SIZE];
+	unsigned long long chunk_bytes=64ULL*1024*1024;
+	unsigned long long image_sectors;
+	unsigned long long offset;
+	unsigned long long live_blank;
+	unsigned long long salvage_end;
+	unsigned long long last_eol;
+	unsigned long long last_data;
+	unsigned long long recovered;
+	_kfs_check_chunk *chunk;
+	_kfs_file_def *file;
+	pthread_t *threads;
+	struct stat st;
+	int usable[KFS_FILE_COUNT];
+	int threads_count=(int)sysconf(_SC_NPROCESSORS_ONLN);
+	int salvage_logs=0;
+	int salvage_all=0;
+	int raw=0;
+	int repair=0;
+	int problems;
+	int changed=0;
+	int errors=0;
+	int fd_index;
+	unsigned int i;
+	double started;
+	double elapsed;
+	int opt;
+
+	while ((opt=getopt(argc, argv, "j:c:sarw"))!=-1)
+	{
+		switch (opt)
+		{
+			case 'j': threads_count=atoi(optarg); break;
+			case 'c': chunk_bytes=strtoull(optarg, NULL, 0)*1024*1024; break;
+			case 's': salvage_logs=1; break;
+			case 'a': salvage_all=1; break;
+			case 'r': raw=1; break;
+			case 'w': repair=1; break;
+			default:  kfs_check_usage(argv[0]);
+		}
+	}
+	if (optind!=argc-1) kfs_check_usage(argv[0]);
+	if (threads_count<1) threads_count=1;
+	if (chunk_bytes<KFS_CHECK_IO_BYTES) chunk_bytes=KFS_CHECK_IO_BYTES;
+
+	memset(&chk, 0, sizeof(chk));
+	chk.image=open(argv[optind], repair ? O_RDWR : O_RDONLY);
+	if (chk.image<0) { perror(argv[optind]); return 2; }
+	if (fstat(chk.image, &st)!=0) { perror("fstat"); return 2; }
+	image_sectors=(unsigned long long)st.st_size/SECTOR_SIZE;
+
+	if (pread(chk.image, sector, SECTOR_SIZE, 0)!=SECTOR_SIZE) { perror("superblock"); return 2; }
+	memcpy(&chk.kfs, sector, sizeof(_kfs));
+
+	if (chk.kfs.kfs_magic!=KFS_MAGIC)     { printf("superblock: invalid MAGIC, image is unformatted\n"); return 1; }
+	if (chk.kfs.kfs_version==KFS_VERSION_0_1) chk.kfs.block_size=SECTOR_SIZE;
+	else if (chk.kfs.kfs_version!=KFS_VERSION) { printf("superblock: unsupported VERSION\n"); return 1; }
+	if ((chk.kfs.block_size<SECTOR_SIZE)||(chk.kfs.block_size%SECTOR_SIZE)||(chk.kfs.block_size&(chk.kfs.block_size-1)))
+	{
+		printf("superblock: invalid block_size %u\n", chk.kfs.block_size);
+		return 1;
+	}
+
+	problems=kfs_check_superblock(&chk.kfs, image_sectors, usable);
+	changed=problems;
+
+	// Split every usable file into chunks in ring order
+	for (fd_index=0; fd_index<KFS_FILE_COUNT; fd_index++)
+	{
+		chk.text[fd_index]=(fd_index==KFS_EVENT_FD_INDEX)||(fd_index==KFS_LOG_FD_INDEX);
+		chk.salvage[fd_index]=salvage_all||(salvage_logs&&chk.text[fd_index]);
+		chk.salvage_limit[fd_index]=KFS_CHECK_NONE;
+		if (usable[fd_index]) chk.chunk_count+=(chk.kfs.files[fd_index].allocated_bytes+chunk_bytes-1)/chunk_bytes;
+	}
+
+	chk.chunks=calloc(chk.chunk_count, sizeof(_kfs_check_chunk));
+	threads=calloc(threads_count, sizeof(pthread_t));
+	if ((chk.chunks==NULL)||(threads==NULL)) { fprintf(stderr, "out of memory\n"); return 2; }
+
+	chunk=chk.chunks;
+	for (fd_index=0; fd_index<KFS_FILE_COUNT; fd_index++)
+	{
+		if (!usable[fd_index]) continue;
+
+		file=&chk.kfs.files[fd_index];
+		for (offset=0; offset<file->allocated_bytes; offset+=chunk_bytes)
+		{
+			chunk->fd_index=fd_index;
+			chunk->begin=offset;
+			chunk->end=offset+chunk_bytes;
+			if (chunk->end>file->allocated_bytes) chunk->end=file->allocated_bytes;
+			chunk++;
+		}
+	}
+
+	pthread_mutex_init(&chk.lock, NULL);
+	started=kfs_check_now();
+
+	for (i=0; i<(unsigned int)threads_count; i++) pthread_create(&threads[i], NULL, kfs_check_worker, &chk);
+	for (i=0; i<(unsigned int)threads_count; i++) pthread_join(threads[i], NULL);
+
+	elapsed=kfs_check_now()-started;
+
+	// Merge the chunk results of each file in ring order
+	for (fd_index=0; fd_index<KFS_FILE_COUNT; fd_index++)
+	{
+		if (!usable[fd_index]) continue;
+
+		file=&chk.kfs.files[fd_index];
+		live_blank=0;
+		salvage_end=KFS_CHECK_NONE;
+		last_eol=KFS_CHECK_NONE;
+		last_data=KFS_CHECK_NONE;
+
+		for (i=0; i<chk.chunk_count; i++)
+		{
+			chunk=&chk.chunks[i];
+			if (chunk->fd_index!=fd_index) continue;
+
+			if (chunk->error)
+			{
+				printf("%-8s: read error at %llu: %s\n", kfs_check_names[fd_index], chunk->begin, strerror(chunk->error));
+				errors++;
+			}
+
+			live_blank+=chunk->live_blank;
+			if (salvage_end!=KFS_CHECK_NONE) continue;
+
+			if (chunk->last_eol!=KFS_CHECK_NONE)  last_eol=chunk->last_eol;
+			if (chunk->last_data!=KFS_CHECK_NONE) last_data=chunk->last_data;
+			if (chunk->first_blank!=KFS_CHECK_NONE) salvage_end=chunk->first_blank;
+		}
+
+		// Firmware and config images are padded with 0x00/0xFF, only records should never be blank
+		if ((live_blank)&&(chk.text[fd_index]))
+		{
+			printf("%-8s: %llu blank sectors inside the first %llu bytes\n", kfs_check_names[fd_index], live_blank, file->file_size);
+			problems++;
+		}
+
+		recovered=raw ? last_data : last_eol;
+		if ((chk.salvage[fd_index])&&(recovered!=KFS_CHECK_NONE)&&(recovered>file->file_size))
+		{
+			if (recovered>file->allocated_bytes-1) recovered=file->allocated_bytes-1;
+
+			printf("%-8s: %llu bytes found past file_size %llu\n", kfs_check_names[fd_index], recovered-file->file_size, file->file_size);
+			file->file_size=recovered;
+			file->write_index=(file->start_index+file->file_size)%file->allocated_bytes;
+			problems++;
+			changed++;
+		}
+
+		printf("%-8s: start=%llu write=%llu size=%llu / %llu\n", kfs_check_names[fd_index], file->start_index, file->write_index, file->file_size, file->allocated_bytes);
+	}
+
+	printf("scanned %llu MB in %.2fs with %d threads, %.1f MB/s\n", chk.bytes_scanned/(1024*1024), elapsed, threads_count, elapsed>0 ? chk.bytes_scanned/(1024.0*1024.0)/elapsed : 0.0);
+
+	if ((repair)&&(changed)&&(!errors))
+	{
+		memcpy(sector, &chk.kfs, sizeof(_kfs));
+		if ((pwrite(chk.image, sector, SECTOR_SIZE, 0)!=SECTOR_SIZE)||(fsync(chk.image)!=0))
+		{
+			perror("writing superblock");
+			return 2;
+		}
+		printf("corrected superblock written\n");
+	}
+	else if (changed)
+	{
+		printf("%d problems found, run with -w to write the corrected superblock\n", problems);
+	}
+
+	pthread_mutex_destroy(&chk.lock);
+	free(threads);
+	free(chk.chunks);
+	close(chk.image);
+
+	return (problems||errors) ? 1 : 0;
+}
@@ -0,0 +1,134 @@
+#ifndef KFS_INSTANCE_H_
+#define KFS_INSTANCE_H_
+
+#include "kfs_port.h"
+#include "kfs_layout.h"
+
+/*  Multi instance interface.  Every function in kfs.h has a _r twin taking the instance to
+ *  work on, so several cards or partitions can be mounted and driven from different tasks at
+ *  once.  The kfs.h functions work on a built in instance bound to the kfs_port.h functions. */
+
+typedef struct
+{
+	int          (*installed)(void *arg);			// non-zero while the card is present
+	KFS_RET      (*disk_initialize)(void *arg);
+	unsigned int (*get_sector_count)(void *arg);
+	KFS_RET      (*write_sector)(void *arg, const unsigned char *buff, unsigned int sector, unsigned int count);	// buff has any alignment, as in kfs_port.h
+	KFS_RET      (*read_sector)(void *arg, unsigned char *buff, unsigned int sector, unsigned int count);
+	void         (*lock)(void *arg);				// held around the sector I/O of one read or write
+	void         (*unlock)(void *arg);
+	KFS_RET      (*discard_sectors)(void *arg, unsigned int sector, unsigned int count);	// optional, NULL if the card cannot discard
+	KFS_RET      (*write_sectors_v)(void *arg, const kfs_sector_seg *seg, unsigned int segcnt);	// optional, NULL issues write_sector per segment
+	KFS_RET      (*read_sectors_v)(void *arg, const kfs_sector_seg *seg, unsigned int segcnt);	// optional, NULL issues read_sector per segment
+	void         (*staging_lock)(void *arg);		// optional short critical section (not the disk lock) around a staging push,
+	void         (*staging_unlock)(void *arg);		// NULL only if a single task writes the event and log files
+}kfs_port_ops;
+
+typedef struct
+{
+	unsigned char sector[KFS_MAX_BLOCK_SIZE];	// one logical block
+	unsigned int  sector_number;				// first sector of the buffered block + 1, 0 when empty
+}_kfs_buffered_sectors;
+
+// Holds event and log records while the disk is absent, remounting or failing
+typedef struct
+{
+	unsigned char data[KFS_STAGING_SIZE_BYTES>0 ? KFS_STAGING_SIZE_BYTES : 1];
+	volatile unsigned int head;	// only moved by producers (kfs_writev), under staging_lock
+	volatile unsigned int tail;	// only moved by kfs_periodic
+	unsigned int overflow;		// bytes dropped because the ring was full
+	unsigned int discarded;		// bytes drained into a full file
+}_kfs_staging;
+
+// Derived from the superblock on mount/format so the per-sector paths only shift and mask
+typedef struct
+{
+	unsigned int block_size;
+	unsigned int block_shift;		// log2(block_size)
+	unsigned int block_mask;		// block_size-1
+	unsigned int block_sectors;
+	unsigned int sector_shift;		// log2(block_sectors)
+	struct
+	{
+		unsigned int sector_start;		// files[].sector_start, always fits the 32 bit port API
+		unsigned long long ring_mask;	// allocated_bytes-1 for power of two files, 0 otherwise
+	}files[KFS_FILE_COUNT];
+}_kfs_geometry;
+
+// Freed bytes [from, to) of a file waiting for kfs_periodic to discard them, empty when from==to
+typedef struct
+{
+	unsigned long long from;
+	unsigned long long to;
+}_kfs_discard;
+
+// Sector transfers of one read or write, handed to the port together by kfs_batch_flush
+typedef struct
+{
+	kfs_sector_seg seg[KFS_BATCH_SEGMENTS];
+	unsigned int segcnt;
+	unsigned char bounce[KFS_MAX_BLOCK_SIZE];	// a block neither the caller's memory nor the file's cache can back
+	int bounce_claimed;			// the bounce block is already part of the list
+	int cache_claimed;			// the file's buffered block is already part of the list
+	struct
+	{
+		unsigned char *dest;
+		const unsigned char *src;
+		unsigned int length;
+	}copy[2];					// partially read blocks (bounce and cache), copied to the caller after the transfer
+	unsigned int copycnt;
+}_kfs_batch;
+
+typedef struct
+{
+	kfs_follow_cb cb;			// NULL when nobody follows the file
+	void *arg;
+	unsigned int threshold;		// unreported bytes that wake the follower
+	unsigned long long reported;	// file_size at the last call
+	unsigned int calls;			// callbacks running outside the lock, kfs_follow_r waits for them
+}_kfs_follow;
+
+typedef struct
+{
+	const kfs_port_ops *port;
+	void *port_arg;
+
+	KFS_RET disk_state;
+	unsigned int next_update_ms;
+	int mounted;					// kfs holds the live superblock, newer than sector 0 until the next kfs_sync
+
+	_kfs kfs;
+	unsigned char superblock[SECTOR_SIZE];	// sector 0 staging for kfs_init/kfs_sync, never a file's cache
+	_kfs_geometry geometry;
+	_kfs_buffered_sectors buffered_sectors[KFS_FILE_COUNT];
+#if KFS_STAGING_SIZE_BYTES>0
+	_kfs_staging staging[2];		// event, log
+#endif
+	_kfs_discard discard[KFS_FILE_COUNT];
+	int discard_synced;				// sector 0 has not seen space freed since, discards may go ahead
+	_kfs_follow follow[KFS_FILE_COUNT];
+	_kfs_batch batch;				// only used with the port lock held
+}kfs_instance;
+
+void kfs_instance_init(kfs_instance *fs, const kfs_port_ops *port, void *port_arg); // Bind an instance to its port, call once before kfs_init_r
+
+KFS_RET kfs_disk_state_r(kfs_instance *fs);
+KFS_RET kfs_init_r(kfs_instance *fs);
+KFS_RET kfs_sync_r(kfs_instance *fs);
+KFS_RET kfs_format_r(kfs_instance *fs);
+KFS_RET kfs_format_ex_r(kfs_instance *fs, unsigned int block_size, unsigned int flags);
+KFS_RET kfs_open_r(kfs_instance *fs, int fd_index, unsigned int flags);
+KFS_RET kfs_seek_r(kfs_instance *fs, int fd_index, long long offset, unsigned int type);
+int kfs_eof_r(kfs_instance *fs, int fd_index);
+unsigned long long kfs_file_size_r(kfs_instance *fs, int fd_index);
+unsigned long long kfs_file_allocated_size_r(kfs_instance *fs, int fd_index);
+int kfs_read_r(kfs_instance *fs, int fd_index, void *buffer, unsigned int length);
+int kfs_write_r(kfs_instance *fs, int fd_index, void *buffer, unsigned int length);
+int kfs_writev_r(kfs_instance *fs, int fd_index, const kfs_iovec *iov, int iovcnt);
+unsigned int kfs_staging_overflow_r(kfs_instance *fs, int fd_index);
+KFS_RET kfs_follow_r(kfs_instance *fs, int fd_index, unsigned int threshold, kfs_follow_cb cb, void *arg);
+char *kfs_gets_r(kfs_instance *fs, int fd_index, char *buffer, unsigned int max_length);
+void kfs_print_stats_r(kfs_instance *fs);
+void kfs_periodic_r(kfs_instance *fs); // Call in idle task for every mounted instance
+
+#endif /*KFS_INSTANCE_H_*/
@@ -0,0 +1,35 @@
+#ifndef KFS_LAYOUT_H_
+#define KFS_LAYOUT_H_
+
+/*  On-disk layout of sector 0, shared by kfs.c and the host tools (kfs_check.c).  */
+
+#define KFS_MAGIC	((unsigned int)(('K'<<0)|('F'<<8)|('S'<<16)|('\0'<<24)))
+#define KFS_VERSION ((unsigned int)(('0'<<0)|('.'<<8)|('2'<<16)|('\0'<<24)))
+#define KFS_VERSION_0_1 ((unsigned int)(('0'<<0)|('.'<<8)|('1'<<16)|('\0'<<24)))	// 512 byte blocks, no block_size field
+
+#define KFS_FILE_COUNT	4
+
+typedef struct
+{
+	unsigned long long sector_start;		// file sector start
+	unsigned long long sector_count;		// number of sectors allocated to this file
+
+	unsigned long long start_index;		// byte index from sector_start to start of actual data (used for circular buffers)
+
+	unsigned long long read_index;		// byte index from sector_start
+	unsigned long long write_index;		// byte index from sector_start
+	
+	unsigned long long file_size;			// size in bytes of this file
+	unsigned long long allocated_bytes;	// total size of file
+}_kfs_file_def;
+
+typedef struct
+{
+	unsigned int kfs_magic; 		// 4 byte magic to indicate raw_fd system
+	unsigned int kfs_version; 		// raw_fd version number 
+	unsigned long long sector_count;
+	_kfs_file_def files[KFS_FILE_COUNT]; 		// config, firmware, event, log files
+	unsigned int block_size;		// bytes per logical block, files are allocated and written in whole blocks
+}_kfs;
+
+#endif /*KFS_LAYOUT_H_*/
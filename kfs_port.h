@@ -8,15 +8,59 @@
 // Set the Sector Size of your disks
 #define SECTOR_SIZE 512
 
+// Largest logical block kfs_format_ex accepts, each file buffers one block of this size.
+// Raise it to the native page size of the card (e.g. 4096) to format with larger blocks and
+// avoid read-modify-write inside the card, at the cost of that much RAM per file.
+#define KFS_MAX_BLOCK_SIZE SECTOR_SIZE
+
+// Block size used when kfs_format formats the disk
+#define KFS_DEFAULT_BLOCK_SIZE SECTOR_SIZE
+
 // returns sector count of disk, this should be the number of write sectors
 unsigned int kfs_get_sector_count(void);
 
 // Perform any initialization you require prior to reading/writing sectors
 KFS_RET kfs_disk_initialize(void);
 
-// Implement full sector read/write operations here
+// Implement full sector read/write operations here.  Whole blocks are transferred straight
+// from/to the caller's memory, so buff can have any alignment and ports must accept that (a
+// DMA engine that needs aligned memory has to bounce through its own buffer).
 KFS_RET kfs_write_sector(const unsigned char *buff, unsigned int sector, unsigned int count);
 KFS_RET kfs_read_sector(unsigned char *buff, unsigned int sector, unsigned int count);
 
+// One run of sectors in a vectored transfer
+typedef struct
+{
+	unsigned int sector;
+	unsigned int count;			// sectors
+	unsigned char *buff;		// count*SECTOR_SIZE bytes, not modified by writes, any alignment (see above)
+}kfs_sector_seg;
+
+// Event and log writes are held in a RAM ring of this size per file while the disk is not
+// available, 0 turns staging off (such writes then fail like writes to any other file)
+#define KFS_STAGING_SIZE_BYTES 1024
+
+// Optional: run a whole segment list as one queued transaction (one bus lock, back to back
+// multi-block commands).  Define KFS_PORT_VECTORED when implemented, otherwise every segment
+// is a separate kfs_write_sector/kfs_read_sector call.
+//#define KFS_PORT_VECTORED
+KFS_RET kfs_write_sectors_v(const kfs_sector_seg *seg, unsigned int segcnt);
+KFS_RET kfs_read_sectors_v(const kfs_sector_seg *seg, unsigned int segcnt);
+
+// Segments collected per kfs_read/kfs_write before they are handed to the port
+#define KFS_BATCH_SEGMENTS 16
+
+// Optional: tell the card the sectors no longer hold data (SD erase/discard, eMMC trim) so its
+// garbage collection stops copying them.  Define KFS_PORT_DISCARD when implemented.
+//#define KFS_PORT_DISCARD
+KFS_RET kfs_discard_sectors(unsigned int sector, unsigned int count);
+
+// Erase block (allocation unit) of the card in sectors, a power of two.  Discards are only
+// issued for whole, aligned erase blocks.
+#define KFS_ERASE_BLOCK_SECTORS 8192
+
+// Erase blocks discarded per kfs_periodic call, bounds how long the idle task holds the disk
+#define KFS_DISCARD_BLOCKS_PER_PASS 4
+
 
 #endif /*KFS_PORT_H_*/